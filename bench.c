@@ -0,0 +1,207 @@
+#include "guest_io.h"
+
+// each benchmark prints a line like:
+// BENCH <name> ops=<n> bytes=<n> cycles=<n>
+// cycles are TSC cycles, the VMM prints the TSC frequency at startup
+
+#define CHUNK_SIZE (64 * 1024)
+#define RANDOM_OPS 1024
+#define RMW_OPS 1024
+#define RMW_SIZE 16
+#define EXIT_OPS 10000
+
+static unsigned long rdtsc(void) {
+    unsigned int lo, hi;
+
+    asm volatile("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((unsigned long)hi << 32) | lo;
+}
+
+static unsigned int rand_state = 12345;
+
+// xorshift32
+static unsigned int rand(void) {
+    rand_state ^= rand_state << 13;
+    rand_state ^= rand_state >> 17;
+    rand_state ^= rand_state << 5;
+    return rand_state;
+}
+
+static void report(const char *name, unsigned long ops, unsigned long bytes,
+                   unsigned long cycles) {
+    puts("BENCH ");
+    puts(name);
+    puts(" ops=");
+    putu(ops);
+    puts(" bytes=");
+    putu(bytes);
+    puts(" cycles=");
+    putu(cycles);
+    puts("\n");
+}
+
+static void report_error(const char *name, int err) {
+    puts("BENCH ");
+    puts(name);
+    puts(" error=");
+    puti(-err);
+    puts("\n");
+}
+
+void bench_seq_write(struct hdd_dev *d, char *buf) {
+    unsigned long start, ops = 0;
+    int res;
+
+    memset(buf, 0x5a, CHUNK_SIZE);
+    start = rdtsc();
+    for (unsigned long off = 0; off + CHUNK_SIZE <= d->status.size;
+         off += CHUNK_SIZE) {
+        res = hdd_write(d, off, buf, CHUNK_SIZE);
+        if (res < 0) {
+            report_error("seq_write", res);
+            return;
+        }
+        ops++;
+    }
+    report("seq_write", ops, ops * CHUNK_SIZE, rdtsc() - start);
+}
+
+void bench_seq_read(struct hdd_dev *d, char *buf) {
+    unsigned long start, ops = 0;
+    int res;
+
+    start = rdtsc();
+    for (unsigned long off = 0; off + CHUNK_SIZE <= d->status.size;
+         off += CHUNK_SIZE) {
+        res = hdd_read(d, off, buf, CHUNK_SIZE);
+        if (res < 0) {
+            report_error("seq_read", res);
+            return;
+        }
+        ops++;
+    }
+    report("seq_read", ops, ops * CHUNK_SIZE, rdtsc() - start);
+}
+
+void bench_ring_seq_read(struct hdd_dev *d, char *buf) {
+    unsigned long start, ops = 0;
+    unsigned sectors = CHUNK_SIZE / HDD_SECTOR_SIZE;
+    int res;
+
+    start = rdtsc();
+    for (unsigned long s = 0; (s + sectors) * HDD_SECTOR_SIZE <= d->status.size;
+         s += sectors) {
+        res = hdd_ring_read(d, s, buf, sectors);
+        if (res < 0) {
+            report_error("ring_seq_read", res);
+            return;
+        }
+        ops++;
+    }
+    report("ring_seq_read", ops, ops * CHUNK_SIZE, rdtsc() - start);
+}
+
+void bench_rand_read(struct hdd_dev *d, char *buf) {
+    unsigned long start;
+    unsigned sectors = d->status.size / HDD_SECTOR_SIZE;
+    int res;
+
+    start = rdtsc();
+    for (int i = 0; i < RANDOM_OPS; i++) {
+        res = hdd_read(d, (rand() % sectors) * HDD_SECTOR_SIZE, buf,
+                       HDD_SECTOR_SIZE);
+        if (res < 0) {
+            report_error("rand_read", res);
+            return;
+        }
+    }
+    report("rand_read", RANDOM_OPS, RANDOM_OPS * HDD_SECTOR_SIZE,
+           rdtsc() - start);
+}
+
+void bench_rand_write(struct hdd_dev *d, char *buf) {
+    unsigned long start;
+    unsigned sectors = d->status.size / HDD_SECTOR_SIZE;
+    int res;
+
+    start = rdtsc();
+    for (int i = 0; i < RANDOM_OPS; i++) {
+        res = hdd_write(d, (rand() % sectors) * HDD_SECTOR_SIZE, buf,
+                        HDD_SECTOR_SIZE);
+        if (res < 0) {
+            report_error("rand_write", res);
+            return;
+        }
+    }
+    report("rand_write", RANDOM_OPS, RANDOM_OPS * HDD_SECTOR_SIZE,
+           rdtsc() - start);
+}
+
+// small unaligned writes go through the read-modify-write path
+void bench_rmw_write(struct hdd_dev *d, char *buf) {
+    unsigned long start;
+    int res;
+
+    start = rdtsc();
+    for (int i = 0; i < RMW_OPS; i++) {
+        res = hdd_write(d, rand() % (d->status.size - RMW_SIZE), buf, RMW_SIZE);
+        if (res < 0) {
+            report_error("rmw_write", res);
+            return;
+        }
+    }
+    report("rmw_write", RMW_OPS, RMW_OPS * RMW_SIZE, rdtsc() - start);
+}
+
+// the sector register has no side effects, so it is used to measure the
+// cost of a bare exit
+void bench_exit_pio(void) {
+    unsigned long start;
+
+    start = rdtsc();
+    for (int i = 0; i < EXIT_OPS; i++) {
+        asm volatile("outl %0, %1" : : "a"(0), "Nd"(HDD_SECTOR_PORT));
+    }
+    report("exit_pio", EXIT_OPS, 0, rdtsc() - start);
+}
+
+void bench_exit_mmio(void) {
+    volatile int *reg =
+        (int *)((unsigned long)(MMIO_ADDR + HDD_SECTOR_PORT * 8));
+    unsigned long start;
+
+    start = rdtsc();
+    for (int i = 0; i < EXIT_OPS; i++) {
+        *reg = 0;
+    }
+    report("exit_mmio", EXIT_OPS, 0, rdtsc() - start);
+}
+
+void main(int cpu) {
+    struct hdd_dev d;
+    volatile struct hdd_ring ring;
+    char *buf;
+
+    if (cpu != 0) {
+        return;
+    }
+
+    if (hdd_setup(&d, 0, 0) || hdd_ring_setup(&d, &ring)) {
+        puts("ERROR setting up disk!\n");
+        return;
+    }
+    buf = malloc(CHUNK_SIZE);
+
+    puts("BENCH disk size=");
+    putu(d.status.size);
+    puts("\n");
+
+    bench_exit_pio();
+    bench_exit_mmio();
+    bench_seq_write(&d, buf);
+    bench_seq_read(&d, buf);
+    bench_ring_seq_read(&d, buf);
+    bench_rand_read(&d, buf);
+    bench_rand_write(&d, buf);
+    bench_rmw_write(&d, buf);
+}
@@ -0,0 +1,130 @@
+#include "bus.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include "io.h"
+
+void bus_init(struct bus *bus) { memset(bus, 0, sizeof(*bus)); }
+
+static int bus_add_range(struct bus *bus, struct bus_device *dev,
+                         uint64_t base) {
+    if (bus->n == BUS_MAX_RANGES) {
+        fprintf(stderr, "too many ranges on the bus\n");
+        return -1;
+    }
+
+    bus->n++;
+    bus->ranges[bus->n].dev = dev;
+    bus->ranges[bus->n].base = base;
+    return bus->n;
+}
+
+int bus_register_pio(struct bus *bus, struct bus_device *dev, uint16_t port,
+                     unsigned int n) {
+    int idx;
+
+    if (port + n > sizeof(bus->pio)) {
+        fprintf(stderr, "%s: bad port range %x+%x\n", dev->name, port, n);
+        return -1;
+    }
+    for (unsigned int i = 0; i < n; i++) {
+        if (bus->pio[port + i]) {
+            fprintf(stderr, "%s: port %x already in use\n", dev->name,
+                    port + i);
+            return -1;
+        }
+    }
+
+    idx = bus_add_range(bus, dev, port);
+    if (idx < 0) return -1;
+    memset(&bus->pio[port], idx, n);
+
+    return 0;
+}
+
+int bus_register_mmio(struct bus *bus, struct bus_device *dev, uint64_t addr,
+                      unsigned int n) {
+    uint64_t reg = (addr - MMIO_ADDR) / MMIO_REG_SIZE;
+    int idx;
+
+    if (addr < MMIO_ADDR || addr % MMIO_REG_SIZE != 0 ||
+        reg + n > sizeof(bus->mmio)) {
+        fprintf(stderr, "%s: bad MMIO range %lx+%x\n", dev->name, addr, n);
+        return -1;
+    }
+    for (unsigned int i = 0; i < n; i++) {
+        if (bus->mmio[reg + i]) {
+            fprintf(stderr, "%s: MMIO address %lx already in use\n",
+                    dev->name, addr + i * MMIO_REG_SIZE);
+            return -1;
+        }
+    }
+
+    idx = bus_add_range(bus, dev, addr);
+    if (idx < 0) return -1;
+    memset(&bus->mmio[reg], idx, n);
+
+    return 0;
+}
+
+int bus_handle_io(struct bus *bus, int vcpu, struct kvm_run *r) {
+    struct bus_range *range = &bus->ranges[bus->pio[r->io.port]];
+    struct bus_device *dev = range->dev;
+    void *data = (char *)r + r->io.data_offset;
+    unsigned int reg = r->io.port - range->base;
+    int res;
+
+    if (dev == NULL) {
+        printf("No handler defined for: direction=%d port=%x size=%d\n",
+               r->io.direction, r->io.port, r->io.size);
+        return -1;
+    }
+
+    if (r->io.direction == KVM_EXIT_IO_OUT) {
+        res = dev->write ? dev->write(dev->opaque, vcpu, reg, data,
+                                      r->io.size, r->io.count)
+                         : -1;
+    } else {
+        res = dev->read ? dev->read(dev->opaque, vcpu, reg, data, r->io.size,
+                                    r->io.count)
+                        : -1;
+    }
+    if (res < 0) return res;
+
+    return r->io.port;
+}
+
+int bus_handle_mmio(struct bus *bus, int vcpu, struct kvm_run *r) {
+    uint64_t addr = r->mmio.phys_addr;
+    uint64_t reg = (addr - MMIO_ADDR) / MMIO_REG_SIZE;
+    struct bus_range *range;
+    struct bus_device *dev;
+    int res;
+
+    if (addr < MMIO_ADDR || reg >= sizeof(bus->mmio)) {
+        printf("No handler defined for: MMIO addr=%llx\n", r->mmio.phys_addr);
+        return -1;
+    }
+    range = &bus->ranges[bus->mmio[reg]];
+    dev = range->dev;
+    if (dev == NULL || addr % MMIO_REG_SIZE + r->mmio.len > MMIO_REG_SIZE) {
+        printf("No handler defined for: MMIO addr=%llx len=%d\n",
+               r->mmio.phys_addr, r->mmio.len);
+        return -1;
+    }
+
+    reg = (addr - range->base) / MMIO_REG_SIZE;
+    if (r->mmio.is_write) {
+        res = dev->write ? dev->write(dev->opaque, vcpu, reg, r->mmio.data,
+                                      r->mmio.len, 1)
+                         : -1;
+    } else {
+        res = dev->read ? dev->read(dev->opaque, vcpu, reg, r->mmio.data,
+                                    r->mmio.len, 1)
+                        : -1;
+    }
+    if (res < 0) return res;
+
+    return (addr - MMIO_ADDR) / MMIO_REG_SIZE;
+}
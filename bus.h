@@ -0,0 +1,45 @@
+#include <linux/kvm.h>
+#include <stdint.h>
+
+// size of the MMIO window at MMIO_ADDR, each register takes 8 bytes
+#define MMIO_SIZE 0x200000
+#define MMIO_REG_SIZE 8
+
+// devices can be registered more than once, slot 0 means no device
+#define BUS_MAX_RANGES 255
+
+// device callbacks, reg is the index of the register inside the range (the
+// same for port and memory-mapped I/O). size is the size of each access and
+// count the number of accesses (only string I/O has count > 1), data holds
+// size * count bytes.
+struct bus_device {
+    const char *name;
+    void *opaque;
+    int (*write)(void *opaque, int vcpu, unsigned int reg, const void *data,
+                 unsigned int size, unsigned int count);
+    int (*read)(void *opaque, int vcpu, unsigned int reg, void *data,
+                unsigned int size, unsigned int count);
+};
+
+struct bus_range {
+    struct bus_device *dev;
+    uint64_t base;
+};
+
+struct bus {
+    struct bus_range ranges[BUS_MAX_RANGES + 1];
+    int n;
+    // flat lookup tables: the index of the range of each port and of each
+    // MMIO register
+    uint8_t pio[1 << 16];
+    uint8_t mmio[MMIO_SIZE / MMIO_REG_SIZE];
+};
+
+extern void bus_init(struct bus *bus);
+extern int bus_register_pio(struct bus *bus, struct bus_device *dev,
+                            uint16_t port, unsigned int n);
+extern int bus_register_mmio(struct bus *bus, struct bus_device *dev,
+                             uint64_t addr, unsigned int n);
+// return the port (or MMIO register) of the access, -1 if it was not handled
+extern int bus_handle_io(struct bus *bus, int vcpu, struct kvm_run *r);
+extern int bus_handle_mmio(struct bus *bus, int vcpu, struct kvm_run *r);
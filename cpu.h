@@ -19,7 +19,7 @@
 #define CR4_MCE		(1u << 6)
 #define CR4_PGE		(1u << 7)
 #define CR4_PCE		(1u << 8)
-#define CR4_OSFXSR	(1u << 8)
+#define CR4_OSFXSR	(1u << 9)
 #define CR4_OSXMMEXCPT	(1u << 10)
 #define CR4_UMIP	(1u << 11)
 #define CR4_VMXE	(1u << 13)
@@ -0,0 +1,134 @@
+#include "dirty.h"
+
+#include <linux/kvm.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+
+int dirty_log_init(struct dirty_log *d, int vm_fd, size_t mem_size,
+                   size_t low_size, size_t image_size) {
+    size_t pages = mem_size / DIRTY_PAGE_SIZE;
+
+    d->vm_fd = vm_fd;
+    d->mem_size = mem_size;
+    d->low_size = low_size;
+    d->image_size = image_size;
+    d->words = (pages + 63) / 64;
+    d->bitmap = calloc(d->words, sizeof(uint64_t));
+    d->scratch = calloc(d->words, sizeof(uint64_t));
+    if (d->bitmap == NULL || d->scratch == NULL) {
+        perror("malloc(dirty bitmap)");
+        return -1;
+    }
+    pthread_mutex_init(&d->lock, NULL);
+
+    return 0;
+}
+
+// the low memory is a multiple of 2 MB and the image slot of 512 KB, so the
+// bitmaps of slots 0 and 1 start on a word boundary
+static int dirty_log_get(struct dirty_log *d) {
+    struct kvm_dirty_log log;
+
+    memset(&log, 0, sizeof(log));
+    if (d->image_size) {
+        log.slot = 2;
+        log.dirty_bitmap = d->scratch;
+        if (ioctl(d->vm_fd, KVM_GET_DIRTY_LOG, &log) < 0) {
+            perror("ioctl(KVM_GET_DIRTY_LOG)");
+            return -1;
+        }
+    }
+
+    log.slot = 0;
+    log.dirty_bitmap = d->scratch + d->image_size / DIRTY_PAGE_SIZE / 64;
+    if (ioctl(d->vm_fd, KVM_GET_DIRTY_LOG, &log) < 0) {
+        perror("ioctl(KVM_GET_DIRTY_LOG)");
+        return -1;
+    }
+
+    if (d->mem_size > d->low_size) {
+        log.slot = 1;
+        log.dirty_bitmap = d->scratch + d->low_size / DIRTY_PAGE_SIZE / 64;
+        if (ioctl(d->vm_fd, KVM_GET_DIRTY_LOG, &log) < 0) {
+            perror("ioctl(KVM_GET_DIRTY_LOG)");
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+long dirty_log_sync(struct dirty_log *d) {
+    long n = 0;
+
+    pthread_mutex_lock(&d->lock);
+    if (dirty_log_get(d) < 0) {
+        pthread_mutex_unlock(&d->lock);
+        return -1;
+    }
+    // count the pages written since the last sync, even if already dirty
+    for (size_t i = 0; i < d->words; i++) {
+        n += __builtin_popcountll(d->scratch[i]);
+        d->bitmap[i] |= d->scratch[i];
+    }
+    pthread_mutex_unlock(&d->lock);
+
+    return n;
+}
+
+void dirty_log_mark(struct dirty_log *d, size_t off, size_t len) {
+    size_t first = off / DIRTY_PAGE_SIZE;
+    size_t last = (off + len - 1) / DIRTY_PAGE_SIZE;
+
+    if (len == 0) return;
+    for (size_t p = first; p <= last; p++) {
+        __atomic_fetch_or(&d->bitmap[p / 64], 1ull << (p % 64),
+                          __ATOMIC_RELAXED);
+    }
+}
+
+int dirty_log_take(struct dirty_log *d, uint64_t *bitmap) {
+    if (dirty_log_sync(d) < 0) return -1;
+
+    pthread_mutex_lock(&d->lock);
+    memcpy(bitmap, d->bitmap, d->words * sizeof(uint64_t));
+    memset(d->bitmap, 0, d->words * sizeof(uint64_t));
+    pthread_mutex_unlock(&d->lock);
+
+    return 0;
+}
+
+int dirty_log_clear(struct dirty_log *d) {
+    if (dirty_log_sync(d) < 0) return -1;
+
+    pthread_mutex_lock(&d->lock);
+    memset(d->bitmap, 0, d->words * sizeof(uint64_t));
+    pthread_mutex_unlock(&d->lock);
+
+    return 0;
+}
+
+static void dirty_rate_timer(void *opaque) {
+    struct dirty_log *d = opaque;
+    long n;
+
+    n = dirty_log_sync(d);
+    if (n < 0) return;
+
+    // the guest output goes to stdout a character at a time, the rate would
+    // land in the middle of its lines
+    fprintf(stderr, "Dirty pages: %ld in %u ms (%.1f MB/s)\n", n,
+            d->interval_ms,
+            n * (double)DIRTY_PAGE_SIZE / (1 << 20) * 1000 / d->interval_ms);
+}
+
+int dirty_log_start_rate(struct dirty_log *d, unsigned int interval_ms,
+                         struct event_loop *loop) {
+    d->interval_ms = interval_ms;
+    d->rate_timer.handler = dirty_rate_timer;
+    d->rate_timer.opaque = d;
+
+    return event_add_timer(loop, &d->rate_timer, interval_ms * 1000000ull);
+}
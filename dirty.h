@@ -0,0 +1,38 @@
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "event.h"
+
+#define DIRTY_PAGE_SIZE 4096
+
+// pages of guest memory written since the last snapshot. KVM only logs the
+// writes of the guest, the devices mark the memory they write themselves.
+// Slot 0 maps the low memory and slot 1 the rest, both are contiguous in the
+// host so one bitmap indexed by the offset in guest memory covers them. A
+// mapped guest image is slot 2, below slot 0.
+struct dirty_log {
+    int vm_fd;
+    size_t mem_size;
+    size_t low_size;
+    size_t image_size;  // start of slot 0
+    uint64_t *bitmap;
+    uint64_t *scratch;  // filled by KVM_GET_DIRTY_LOG
+    size_t words;
+    pthread_mutex_t lock;
+    struct event rate_timer;
+    unsigned int interval_ms;
+};
+
+extern int dirty_log_init(struct dirty_log *d, int vm_fd, size_t mem_size,
+                          size_t low_size, size_t image_size);
+// collects the pages logged by KVM, returns how many the guest wrote since
+// the last call
+extern long dirty_log_sync(struct dirty_log *d);
+extern void dirty_log_mark(struct dirty_log *d, size_t off, size_t len);
+// collects the log and hands over the dirty pages, clearing them
+extern int dirty_log_take(struct dirty_log *d, uint64_t *bitmap);
+extern int dirty_log_clear(struct dirty_log *d);
+// prints the dirty page rate every interval_ms, from the event loop
+extern int dirty_log_start_rate(struct dirty_log *d, unsigned int interval_ms,
+                                struct event_loop *loop);
@@ -0,0 +1,101 @@
+#include "event.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+static void *event_thread(void *arg) {
+    struct event_loop *l = arg;
+    struct epoll_event ev;
+    struct event *e;
+    uint64_t count;
+    int n;
+
+    for (;;) {
+        n = epoll_wait(l->epfd, &ev, 1, -1);
+        if (n < 0) {
+            perror("epoll_wait");
+            return NULL;
+        }
+        if (n == 0) continue;
+
+        e = ev.data.ptr;
+        if (read(e->fd, &count, sizeof(count)) < 0) {
+            perror("read(event)");
+        }
+        e->handler(e->opaque);
+
+        // the fd is disabled after each event, so that only this thread
+        // handles it
+        ev.events = EPOLLIN | EPOLLONESHOT;
+        if (epoll_ctl(l->epfd, EPOLL_CTL_MOD, e->fd, &ev) < 0) {
+            perror("epoll_ctl(EPOLL_CTL_MOD)");
+        }
+    }
+
+    return NULL;
+}
+
+int event_loop_init(struct event_loop *l, int nr_threads) {
+    int res;
+
+    l->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (l->epfd < 0) {
+        perror("epoll_create1");
+        return -1;
+    }
+    l->nr_threads = nr_threads;
+    l->threads = calloc(nr_threads, sizeof(pthread_t));
+    if (l->threads == NULL) {
+        perror("malloc(event threads)");
+        return -1;
+    }
+
+    for (int i = 0; i < nr_threads; i++) {
+        res = pthread_create(&l->threads[i], NULL, event_thread, l);
+        if (res != 0) {
+            fprintf(stderr, "pthread_create: %s\n", strerror(res));
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+int event_add(struct event_loop *l, struct event *e) {
+    struct epoll_event ev = {
+        .events = EPOLLIN | EPOLLONESHOT,
+        .data.ptr = e,
+    };
+
+    if (epoll_ctl(l->epfd, EPOLL_CTL_ADD, e->fd, &ev) < 0) {
+        perror("epoll_ctl(EPOLL_CTL_ADD)");
+        return -1;
+    }
+
+    return 0;
+}
+
+int event_add_timer(struct event_loop *l, struct event *e,
+                    uint64_t interval_ns) {
+    struct itimerspec t = {
+        .it_interval.tv_sec = interval_ns / 1000000000,
+        .it_interval.tv_nsec = interval_ns % 1000000000,
+    };
+
+    t.it_value = t.it_interval;
+    e->fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+    if (e->fd < 0) {
+        perror("timerfd_create");
+        return -1;
+    }
+    if (timerfd_settime(e->fd, 0, &t, NULL) < 0) {
+        perror("timerfd_settime");
+        return -1;
+    }
+
+    return event_add(l, e);
+}
@@ -0,0 +1,26 @@
+#include <pthread.h>
+#include <stdint.h>
+
+// the threads waiting for the events of the devices of all the VMs (disk
+// kicks, timers) and calling their handlers. Each fd is handled by one thread
+// at a time.
+struct event_loop {
+    int epfd;
+    int nr_threads;
+    pthread_t *threads;
+};
+
+// every fd is an eventfd or a timerfd, the loop reads its counter before
+// calling the handler
+struct event {
+    int fd;
+    void (*handler)(void *opaque);
+    void *opaque;
+};
+
+extern int event_loop_init(struct event_loop *l, int nr_threads);
+// e must stay allocated while the fd is in the loop
+extern int event_add(struct event_loop *l, struct event *e);
+// creates a timer firing every interval_ns, in e->fd
+extern int event_add_timer(struct event_loop *l, struct event *e,
+                           uint64_t interval_ns);
@@ -10,7 +10,7 @@ const char LOREM_IPSUM[HDD_SECTOR_SIZE] =
     "orci. Etiam suscipit, lacus at facilisis gravida, ipsum lectus aliquet "
     "sapien.";
 
-int test_lorem_ipsum(volatile struct hdd_status *h, int offset, int size) {
+int test_lorem_ipsum(struct hdd_dev *d, int offset, int size) {
     char *buf = malloc(size);
     int res;
 
@@ -20,11 +20,12 @@ int test_lorem_ipsum(volatile struct hdd_status *h, int offset, int size) {
     puti(size);
     puts("\n");
 
-    for (int i = 0; i < size; i++) {
-        buf[i] = LOREM_IPSUM[i % HDD_SECTOR_SIZE];
+    for (int i = 0; i < size; i += HDD_SECTOR_SIZE) {
+        memcpy(buf + i, LOREM_IPSUM,
+               size - i < HDD_SECTOR_SIZE ? size - i : HDD_SECTOR_SIZE);
     }
 
-    res = hdd_write(h, offset, buf, size);
+    res = hdd_write(d, offset, buf, size);
     if (res < 0) {
         puts("error writing to disk: ");
         puti(res);
@@ -43,7 +44,7 @@ int test_lorem_ipsum(volatile struct hdd_status *h, int offset, int size) {
     puti(size);
     puts("\n");
 
-    res = hdd_read(h, offset, buf, size);
+    res = hdd_read(d, offset, buf, size);
     if (res < 0) {
         puts("error reading from disk: ");
         puti(res);
@@ -62,6 +63,14 @@ int test_lorem_ipsum(volatile struct hdd_status *h, int offset, int size) {
 
     res = 0;
     for (int i = 0; i < size; i++) {
+        // compare whole sectors, and find the byte only on mismatch
+        if (i % HDD_SECTOR_SIZE == 0 &&
+            memcmp(buf + i, LOREM_IPSUM,
+                   size - i < HDD_SECTOR_SIZE ? size - i : HDD_SECTOR_SIZE) ==
+                0) {
+            i += HDD_SECTOR_SIZE - 1;
+            continue;
+        }
         if (buf[i] != LOREM_IPSUM[i % HDD_SECTOR_SIZE]) {
             res = 1;
             puts(
@@ -82,6 +91,60 @@ int test_lorem_ipsum(volatile struct hdd_status *h, int offset, int size) {
     return res;
 }
 
+int test_ring_lorem_ipsum(struct hdd_dev *d, int sector, int count) {
+    int size = count * HDD_SECTOR_SIZE;
+    char *buf = malloc(size);
+    int res;
+
+    puts("writing to disk through ring: sector=");
+    puti(sector);
+    puts(", count=");
+    puti(count);
+    puts("\n");
+
+    for (int i = 0; i < size; i += HDD_SECTOR_SIZE) {
+        memcpy(buf + i, LOREM_IPSUM, HDD_SECTOR_SIZE);
+    }
+
+    res = hdd_ring_write(d, sector, buf, count);
+    if (res < 0) {
+        puts("error writing to disk: ");
+        puti(res);
+        puts("\n");
+        return res;
+    }
+
+    memset(buf, 0, size);
+
+    res = hdd_ring_read(d, sector, buf, count);
+    if (res < 0) {
+        puts("error reading from disk: ");
+        puti(res);
+        puts("\n");
+        return res;
+    }
+    puts("read complete, bytes read: ");
+    puti(res);
+    puts("\n");
+
+    puts("validating read... ");
+    for (int i = 0; i < size; i++) {
+        if (i % HDD_SECTOR_SIZE == 0 &&
+            memcmp(buf + i, LOREM_IPSUM, HDD_SECTOR_SIZE) == 0) {
+            i += HDD_SECTOR_SIZE - 1;
+            continue;
+        }
+        if (buf[i] != LOREM_IPSUM[i % HDD_SECTOR_SIZE]) {
+            puts("ERROR\nOffset: ");
+            puti(i);
+            puts("\n");
+            return 1;
+        }
+    }
+    puts("OK\n");
+    return 0;
+}
+
 #define EXPECT(expected, actual)      \
     do {                              \
         puts(__func__);               \
@@ -96,50 +159,324 @@ int test_lorem_ipsum(volatile struct hdd_status *h, int offset, int size) {
         }                             \
     } while (0);
 
-void test_lorem_ipsum_first_sector_aligned(volatile struct hdd_status *h) {
-    int res = test_lorem_ipsum(h, 0, HDD_SECTOR_SIZE);
+// for the tests that only make sense in some configurations
+#define SKIP(reason)          \
+    do {                      \
+        puts(__func__);       \
+        puts(" skipped: ");   \
+        puts(reason);         \
+        puts("\n\n");         \
+    } while (0);
+
+void test_lorem_ipsum_first_sector_aligned(struct hdd_dev *d) {
+    int res = test_lorem_ipsum(d, 0, HDD_SECTOR_SIZE);
+    EXPECT(0, res);
+}
+
+void test_lorem_ipsum_first_sector_part(struct hdd_dev *d) {
+    int res = test_lorem_ipsum(d, 0, 50);
+    EXPECT(0, res);
+}
+
+void test_lorem_ipsum_second_sector_aligned(struct hdd_dev *d) {
+    int res = test_lorem_ipsum(d, HDD_SECTOR_SIZE, HDD_SECTOR_SIZE);
+    EXPECT(0, res);
+}
+
+void test_lorem_ipsum_second_sector_part(struct hdd_dev *d) {
+    int res = test_lorem_ipsum(d, HDD_SECTOR_SIZE, 50);
     EXPECT(0, res);
 }
 
-void test_lorem_ipsum_first_sector_part(volatile struct hdd_status *h) {
-    int res = test_lorem_ipsum(h, 0, 50);
+int test_lorem_ipsum_two_sectors_aligned(struct hdd_dev *d) {
+    int res = test_lorem_ipsum(d, 0, 2 * HDD_SECTOR_SIZE);
     EXPECT(0, res);
 }
 
-void test_lorem_ipsum_second_sector_aligned(volatile struct hdd_status *h) {
-    int res = test_lorem_ipsum(h, HDD_SECTOR_SIZE, HDD_SECTOR_SIZE);
+int test_lorem_ipsum_two_sectors_misaligned(struct hdd_dev *d) {
+    int res = test_lorem_ipsum(d, 50, 2 * HDD_SECTOR_SIZE);
     EXPECT(0, res);
 }
 
-void test_lorem_ipsum_second_sector_part(volatile struct hdd_status *h) {
-    int res = test_lorem_ipsum(h, HDD_SECTOR_SIZE, 50);
+int test_lorem_ipsum_many_sectors_misaligned(struct hdd_dev *d) {
+    int res = test_lorem_ipsum(d, 50, 5 * HDD_SECTOR_SIZE);
     EXPECT(0, res);
 }
 
-int test_lorem_ipsum_two_sectors_aligned(volatile struct hdd_status *h) {
-    int res = test_lorem_ipsum(h, 0, 2 * HDD_SECTOR_SIZE);
+int test_lorem_ipsum_all_sectors_aligned(struct hdd_dev *d) {
+    int res = test_lorem_ipsum(d, 0, d->status.size);
     EXPECT(0, res);
 }
 
-int test_lorem_ipsum_two_sectors_misaligned(volatile struct hdd_status *h) {
-    int res = test_lorem_ipsum(h, 50, 2 * HDD_SECTOR_SIZE);
+int test_lorem_ipsum_bad_sector(struct hdd_dev *d) {
+    int res = test_lorem_ipsum(d, d->status.size,
+                               d->status.size + HDD_SECTOR_SIZE);
+    EXPECT(-EINVAL, res);
+}
+
+// checks the word and rep string paths against byte loops, at the sizes and
+// alignments around the 8 bytes words and the rep threshold
+int test_string_functions(void) {
+    char *a = malloc(1100), *b = malloc(1100);
+    int sizes[] = {0, 1, 7, 8, 9, 33, 255, 256, 1000};
+
+    for (unsigned s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        for (int off = 0; off < 3; off++) {
+            unsigned n = sizes[s];
+
+            for (unsigned i = 0; i < 1100; i++) {
+                a[i] = i * 7;
+                b[i] = 0;
+            }
+            memcpy(b + off, a + off, n);
+            for (unsigned i = 0; i < 1100; i++) {
+                if (b[i] != ((i >= (unsigned)off && i < off + n) ? a[i] : 0))
+                    return 1;
+            }
+            if (memcmp(a + off, b + off, n) != 0) return 2;
+            if (n && (b[off + n - 1]++, memcmp(a + off, b + off, n) >= 0))
+                return 3;
+
+            memset(b + off, 0x5a, n);
+            for (unsigned i = off; i < off + n; i++) {
+                if (b[i] != 0x5a) return 4;
+            }
+            if (b[off + n] == 0x5a) return 5;
+        }
+    }
+    return 0;
+}
+
+void test_guest_string_functions(void) {
+    int res = test_string_functions();
     EXPECT(0, res);
 }
 
-int test_lorem_ipsum_all_sectors_aligned(volatile struct hdd_status *h) {
-    int res = test_lorem_ipsum(h, 0, h->size);
+// the sector register holds the last sector that was accessed
+void test_hdd_read_register(struct hdd_dev *d) {
+    char buf[HDD_SECTOR_SIZE];
+
+    hdd_read(d, 3 * HDD_SECTOR_SIZE, buf, HDD_SECTOR_SIZE);
+    EXPECT(3, hdd_get_sector(d));
+}
+
+void test_ring_all_sectors(struct hdd_dev *d) {
+    int res = test_ring_lorem_ipsum(d, 0, d->status.size / HDD_SECTOR_SIZE);
     EXPECT(0, res);
 }
 
-int test_lorem_ipsum_bad_sector(volatile struct hdd_status *h) {
-    int res = test_lorem_ipsum(h, h->size, h->size + HDD_SECTOR_SIZE);
+void test_ring_bad_sector(struct hdd_dev *d) {
+    int res =
+        test_ring_lorem_ipsum(d, d->status.size / HDD_SECTOR_SIZE - 1, 2);
     EXPECT(-EINVAL, res);
 }
 
-void main() {
-    volatile struct hdd_status h;
+static void test_async_count(struct hdd_request *req, void *opaque) {
+    (*(int *)opaque)++;
+}
+
+// the requests are all in flight before the first wait; the device may
+// complete them in any order, so the reads only start after the writes. The
+// host keeps using the queue and its ring after the test returns, so they are
+// on the heap.
+void test_async_requests(int disk) {
+    volatile struct hdd_ring *ring = malloc(sizeof(*ring));
+    struct hdd_dev *q = malloc(sizeof(*q));
+    struct hdd_request reqs[9];
+    char *buf = malloc(9 * HDD_SECTOR_SIZE);
+    int completed = 0, res;
+
+    res = hdd_setup(q, disk, 3);
+    if (!res) res = hdd_ring_setup(q, ring);
+    if (res) {
+        EXPECT(0, res);
+        return;
+    }
+    hdd_irq_enable(q);
+
+    for (int i = 0; i < 9; i++) {
+        reqs[i].cmd = HDD_CMD_WRITE;
+        reqs[i].sector = i;
+        reqs[i].buf = (char *)LOREM_IPSUM;
+        reqs[i].callback = test_async_count;
+        reqs[i].opaque = &completed;
+        if (i < 8) res |= hdd_submit(q, &reqs[i]);
+    }
+    for (int i = 0; i < 8; i++) res |= hdd_wait(q, &reqs[i]);
+
+    memset(buf, 0, 9 * HDD_SECTOR_SIZE);
+    for (int i = 0; i < 9; i++) {
+        reqs[i].cmd = HDD_CMD_READ;
+        reqs[i].buf = buf + i * HDD_SECTOR_SIZE;
+    }
+    reqs[8].sector = q->status.size / HDD_SECTOR_SIZE;
+    for (int i = 0; i < 9; i++) res |= hdd_submit(q, &reqs[i]);
+    for (int i = 0; i < 8; i++) {
+        res |= hdd_wait(q, &reqs[i]);
+        res |= memcmp(buf + i * HDD_SECTOR_SIZE, LOREM_IPSUM, HDD_SECTOR_SIZE);
+    }
+    hdd_wait(q, &reqs[8]);
+    EXPECT(1, res == 0 && completed == 17 && reqs[8].res == -EINVAL);
+}
+
+// the pages written by the disk are not logged by KVM, the host must still
+// save them in the delta snapshot
+void test_snapshot_delta(struct hdd_dev *d) {
+    // a page that the guest itself never writes
+    char *buf = (char *)(((unsigned long)malloc(8192) + 4095) & ~4095ul);
+    int restored;
+
+    hdd_read(d, 0, buf, HDD_SECTOR_SIZE);
+    restored = snapshot();
+    if (!restored) {
+        SKIP("not restored from a snapshot");
+        return;
+    }
+    EXPECT(1, buf[0] == 'L');
+}
+
+// partial writes stay in the cache until flushed, the ring reads the disk.
+// The cache has its own queue, so that the other tests of the first queue
+// go through the read-modify-write path.
+void test_cache_flush(struct hdd_dev *d) {
+    char *buf = malloc(HDD_SECTOR_SIZE);
+    struct hdd_dev *c = malloc(sizeof(*c));
+    int before = 0, after = 0, res;
+
+    hdd_setup(c, 0, 1);
+    hdd_cache_init(c, 8);
+    res = test_lorem_ipsum(c, HDD_SECTOR_SIZE + 50, 50);
+    // the sector was filled with lorem ipsum by the previous tests
+    hdd_write(c, 100, "#", 1);
+    hdd_ring_read(d, 0, buf, 1);
+    before = buf[100] == '#';
+    hdd_flush(c);
+    hdd_ring_read(d, 0, buf, 1);
+    after = buf[100] == '#';
+    EXPECT(1, res == 0 && !before && after);
+}
+
+// FUA is only valid on writes, flushes need no buffer
+void test_ring_flush(struct hdd_dev *d) {
+    char *buf = malloc(HDD_SECTOR_SIZE);
+    int write, flush, read, res;
+
+    hdd_ring_read(d, 1, buf, 1);
+    write = hdd_ring_add(d, HDD_CMD_WRITE | HDD_CMD_FUA, 1, buf);
+    flush = hdd_ring_add(d, HDD_CMD_FLUSH, 0, NULL);
+    read = hdd_ring_add(d, HDD_CMD_READ | HDD_CMD_FUA, 1, buf);
+    res = hdd_ring_kick(d);
+    EXPECT(1, res == -EINVAL && !d->ring->desc[write].err &&
+                  !d->ring->desc[flush].err &&
+                  d->ring->desc[read].err == EINVAL);
+}
+
+// each queue has its own registers and cache, the disk is the same
+void test_hdd_queues(struct hdd_dev *d) {
+    char *a = malloc(HDD_SECTOR_SIZE), *b = malloc(HDD_SECTOR_SIZE);
+    struct hdd_dev q;
+    int regs;
+
+    hdd_flush(d);
+    hdd_setup(&q, 0, 1);
+    hdd_read(&q, 2 * HDD_SECTOR_SIZE, a, HDD_SECTOR_SIZE);
+    hdd_read(d, HDD_SECTOR_SIZE, b, HDD_SECTOR_SIZE);
+    regs = hdd_get_sector(&q) == 2 && hdd_get_sector(d) == 1;
+    hdd_read(&q, HDD_SECTOR_SIZE, a, HDD_SECTOR_SIZE);
+    EXPECT(1, regs && memcmp(a, b, HDD_SECTOR_SIZE) == 0);
+}
+
+// the other disks are separate devices, with their own image
+void test_second_disk(struct hdd_dev *d, int nr_disks) {
+    char *a = malloc(HDD_SECTOR_SIZE), *b = malloc(HDD_SECTOR_SIZE);
+    struct hdd_dev d1;
     int res;
 
+    if (nr_disks < 2) {
+        SKIP("a single disk");
+        return;
+    }
+
+    res = hdd_setup(&d1, 1, 0);
+    if (!res) res = test_lorem_ipsum(&d1, 0, d1.status.size);
+    hdd_write(&d1, 0, "#", 1);
+    hdd_read(&d1, 0, a, 1);
+    hdd_read(d, 0, b, 1);
+    EXPECT(1, res == 0 && a[0] == '#' && b[0] == 'L');
+}
+
+static void timer_handler(void *opaque) { *(volatile int *)opaque = 1; }
+
+// the LAPIC timer fires once, HLT waits for it
+void test_timer_interrupt(void) {
+    volatile int fired = 0;
+
+    irq_register(IRQ_TIMER_VECTOR, timer_handler, (void *)&fired);
+    lapic_write(LAPIC_TIMER_DIVIDE, LAPIC_TIMER_DIVIDE_1);
+    lapic_write(LAPIC_LVT_TIMER, IRQ_TIMER_VECTOR);  // one-shot, unmasked
+    lapic_write(LAPIC_TIMER_INITIAL, 100000);
+    while (!fired) irq_idle();
+    EXPECT(1, fired);
+}
+
+// the DAX window and the disk commands see the same data
+void test_dax(int nr_disks) {
+    char *a = malloc(HDD_SECTOR_SIZE), *b = malloc(HDD_SECTOR_SIZE);
+    struct hdd_dev q;
+    int res;
+
+    // a queue without cache, which would hide the writes through the window
+    res = hdd_setup(&q, nr_disks - 1, 2);
+    if (res) {
+        EXPECT(0, res);
+        return;
+    }
+    if (hdd_dax(&q) == NULL) {
+        SKIP("the disk is not mapped (--dax)");
+        return;
+    }
+
+    hdd_dax_write(&q, 3 * HDD_SECTOR_SIZE + 10, "DAX", 3);
+    res = hdd_dax_flush(&q, 3 * HDD_SECTOR_SIZE + 10, 3);
+    hdd_read(&q, 3 * HDD_SECTOR_SIZE, a, HDD_SECTOR_SIZE);
+    memset(b, '#', HDD_SECTOR_SIZE);
+    hdd_write(&q, 4 * HDD_SECTOR_SIZE, b, HDD_SECTOR_SIZE);
+    EXPECT(1, res == 0 && memcmp(a + 10, "DAX", 3) == 0 &&
+                  memcmp(hdd_dax(&q) + 4 * HDD_SECTOR_SIZE, b,
+                         HDD_SECTOR_SIZE) == 0 &&
+                  hdd_dax_read(&q, q.status.dax_size - 1, a, 2) == -EINVAL);
+}
+
+// checks that the last word of RAM is usable (the first 2 MB end with the
+// stacks, so there's nothing to check if there is no more)
+void test_mem_last_word(unsigned long mem_size) {
+    volatile unsigned long *last;
+
+    if (mem_size <= (2 << 20)) {
+        SKIP("no memory above the stacks");
+        return;
+    } else if (mem_size <= MMIO_ADDR) {
+        last = (unsigned long *)(mem_size - sizeof(*last));
+    } else {
+        last = (unsigned long *)(HIGH_MEM_ADDR + mem_size - MMIO_ADDR -
+                                 sizeof(*last));
+    }
+
+    *last = 0x1234567890abcdef;
+    EXPECT(1, *last == 0x1234567890abcdef);
+}
+
+void main(int cpu, unsigned long mem_size, int nr_disks) {
+    struct hdd_dev d;
+    volatile struct hdd_ring ring;
+    int res;
+
+    // the tests use the first queue of the disk, so they only run on the first
+    // vCPU
+    if (cpu != 0) {
+        return;
+    }
+
     puts("Hello world! I'm using ");
 #ifdef USE_MMIO
     puts("MMIO");
@@ -148,19 +485,49 @@ void main() {
 #endif
     puts("\n");
 
-    res = hdd_setup(&h);
+    res = hdd_setup(&d, 0, 0);
     if (res) {
         puts("ERROR setting up disk!\n");
         return;
     }
     puts("Disk set up!\n");
 
-    test_lorem_ipsum_first_sector_aligned(&h);
-    test_lorem_ipsum_first_sector_part(&h);
-    test_lorem_ipsum_second_sector_aligned(&h);
-    test_lorem_ipsum_second_sector_part(&h);
-    test_lorem_ipsum_two_sectors_aligned(&h);
-    test_lorem_ipsum_two_sectors_misaligned(&h);
-    test_lorem_ipsum_all_sectors_aligned(&h);
-    test_lorem_ipsum_bad_sector(&h);
+    // the state of the disk is part of the snapshot, and is still set up
+    // after restoring it
+    if (snapshot()) puts("Restored from snapshot!\n");
+
+    test_mem_last_word(mem_size);
+    test_guest_string_functions();
+
+    test_lorem_ipsum_first_sector_aligned(&d);
+    test_lorem_ipsum_first_sector_part(&d);
+    test_lorem_ipsum_second_sector_aligned(&d);
+    test_lorem_ipsum_second_sector_part(&d);
+    test_lorem_ipsum_two_sectors_aligned(&d);
+    test_lorem_ipsum_two_sectors_misaligned(&d);
+    test_lorem_ipsum_many_sectors_misaligned(&d);
+    test_lorem_ipsum_all_sectors_aligned(&d);
+    test_lorem_ipsum_bad_sector(&d);
+    test_hdd_read_register(&d);
+    test_snapshot_delta(&d);
+    test_hdd_queues(&d);
+    test_second_disk(&d, nr_disks);
+
+    res = hdd_ring_setup(&d, &ring);
+    if (res) {
+        puts("ERROR setting up disk ring!\n");
+        return;
+    }
+    puts("Disk ring set up!\n");
+
+    irq_init();
+    test_timer_interrupt();
+    hdd_irq_enable(&d);
+
+    test_cache_flush(&d);
+    test_ring_flush(&d);
+    test_ring_all_sectors(&d);
+    test_ring_bad_sector(&d);
+    test_async_requests(0);
+    test_dax(nr_disks);
 }
@@ -14,6 +14,14 @@ static void outl(const int l, const ioport port) {
     *(int*)((unsigned long)(MMIO_ADDR+port*8)) = l;
 }
 
+static void outsb(const char *buf, unsigned size, const ioport port) {
+    for (unsigned i = 0; i < size; i++) outb(buf[i], port);
+}
+
+static int inl(const ioport port) {
+    return *(volatile int*)((unsigned long)(MMIO_ADDR+port*8));
+}
+
 #else
 
 static void outb(const char b, const ioport port) {
@@ -28,31 +36,100 @@ static void outl(const int l, const ioport port) {
         : "r"(l), "r"(port));
 }
 
+// the whole buffer is sent with a single exit
+static void outsb(const char *buf, unsigned size, const ioport port) {
+    asm volatile("rep outsb"
+                 : "+S"(buf), "+c"(size)
+                 : "d"(port)
+                 : "memory");
+}
+
+static int inl(const ioport port) {
+    int l;
+
+    asm volatile("inl %1, %0" : "=a"(l) : "d"(port));
+    return l;
+}
+
 #endif
 
+// copies above this size use rep movsb/stosb (fast on ERMS CPUs), smaller
+// ones 8 bytes at a time. SSE is not used: where KVM shadows the guest page
+// tables (e.g. PVM) it emulates the instructions around the faulting accesses,
+// and its emulator lacks most SSE instructions (pcmpeqb stops the VM with
+// KVM_EXIT_INTERNAL_ERROR).
+#define REP_THRESHOLD 256
+
 void memcpy(char *dest, const char *src, unsigned size) {
+    if (size >= REP_THRESHOLD) {
+        asm volatile("rep movsb"
+                     : "+D"(dest), "+S"(src), "+c"(size)
+                     :
+                     : "memory");
+        return;
+    }
+
+    for (; size >= 8; size -= 8, dest += 8, src += 8) {
+        *(unsigned long *)dest = *(const unsigned long *)src;
+    }
     for (unsigned i = 0; i < size; i++) {
         dest[i] = src[i];
     }
 }
 
 void memset(char *buf, char c, unsigned size) {
+    unsigned long pattern = 0x0101010101010101ul * (unsigned char)c;
+
+    if (size >= REP_THRESHOLD) {
+        asm volatile("rep stosb"
+                     : "+D"(buf), "+c"(size)
+                     : "a"(c)
+                     : "memory");
+        return;
+    }
+
+    for (; size >= 8; size -= 8, buf += 8) {
+        *(unsigned long *)buf = pattern;
+    }
     for (unsigned i = 0; i < size; i++) {
         buf[i] = c;
     }
 }
 
-void *malloc(unsigned size) {
-    void *res = heap_p;
+// compares 8 bytes at a time, the first differing byte is the lowest one set
+// in the xor of the words (x86 is little endian)
+int memcmp(const char *a, const char *b, unsigned size) {
+    unsigned long diff;
+    unsigned i = 0;
+
+    for (; i + 8 <= size; i += 8) {
+        diff = *(const unsigned long *)(a + i) ^
+               *(const unsigned long *)(b + i);
+        if (diff != 0) {
+            i += __builtin_ctzl(diff) / 8;
+            return (unsigned char)a[i] - (unsigned char)b[i];
+        }
+    }
+    for (; i < size; i++) {
+        if (a[i] != b[i]) return (unsigned char)a[i] - (unsigned char)b[i];
+    }
+    return 0;
+}
 
-    heap_p += size;
-    return res;
+// the heap is shared by all the vCPUs
+void *malloc(unsigned size) {
+    return __atomic_fetch_add(&heap_p, size, __ATOMIC_RELAXED);
 }
 
 void putc(char c) { outb(c, SERIAL_PORT); }
 
+void write(const char *buf, unsigned size) { outsb(buf, size, SERIAL_PORT); }
+
 void puts(const char *s) {
-    while (*s != '\0') putc(*(s++));
+    unsigned len = 0;
+
+    while (s[len] != '\0') len++;
+    write(s, len);
 }
 
 void puti(int i) {
@@ -77,40 +154,290 @@ void puti(int i) {
     }
 }
 
+void putu(unsigned long u) {
+    char buf[20];
+    int n = 0;
+
+    do {
+        buf[n++] = '0' + u % 10;
+        u /= 10;
+    } while (u);
+
+    while (n) putc(buf[--n]);
+}
+
 #define OFF32(x) ((int)(((unsigned long)(x)) & 0xffffffff))
 
-int hdd_setup(volatile struct hdd_status *h) {
-    h->err = 1;
-    outl(OFF32(h), HDD_DMA_ADDR_PORT);
-    outb(HDD_CMD_SETUP, HDD_CMD_PORT);
-    return h->err;  // device will set to 0 when correctly setup
+// a 64-bit interrupt gate
+struct idt_entry {
+    unsigned short offset_low;
+    unsigned short selector;
+    unsigned char ist;
+    unsigned char type;
+    unsigned short offset_mid;
+    unsigned int offset_high;
+    unsigned int reserved;
+};
+
+#define IDT_ENTRIES (IRQ_VECTOR_BASE + IRQ_VECTORS)
+#define IDT_INTERRUPT_GATE 0x8e  // present, DPL 0
+#define CODE_SELECTOR 8
+
+#define LAPIC_ID 0x20
+#define LAPIC_EOI 0xb0
+#define LAPIC_SVR 0xf0
+#define LAPIC_SVR_ENABLE 0x100
+
+#define IOAPIC_REGSEL 0x00
+#define IOAPIC_WINDOW 0x10
+#define IOAPIC_REDIR(pin) (0x10 + 2 * (pin))
+
+// the entry points in guest_load.s, 8 bytes each
+extern char irq_stubs[];
+
+// shared by all the vCPUs, the exceptions below IRQ_VECTOR_BASE are not
+// handled
+static struct idt_entry idt[IDT_ENTRIES];
+static struct {
+    void (*handler)(void *opaque);
+    void *opaque;
+} irq_handlers[IRQ_VECTORS];
+
+unsigned int lapic_read(unsigned int reg) {
+    return *(volatile unsigned int *)(unsigned long)(LAPIC_ADDR + reg);
+}
+
+void lapic_write(unsigned int reg, unsigned int val) {
+    *(volatile unsigned int *)(unsigned long)(LAPIC_ADDR + reg) = val;
+}
+
+static void ioapic_write(unsigned int reg, unsigned int val) {
+    *(volatile unsigned int *)(IOAPIC_ADDR + IOAPIC_REGSEL) = reg;
+    *(volatile unsigned int *)(IOAPIC_ADDR + IOAPIC_WINDOW) = val;
+}
+
+void irq_init(void) {
+    struct {
+        unsigned short limit;
+        unsigned long base;
+    } __attribute__((packed)) idtr = {sizeof(idt) - 1, (unsigned long)idt};
+    unsigned long stub;
+
+    for (int i = IRQ_VECTOR_BASE; i < IDT_ENTRIES; i++) {
+        stub = (unsigned long)irq_stubs + (i - IRQ_VECTOR_BASE) * 8;
+        idt[i].offset_low = stub & 0xffff;
+        idt[i].selector = CODE_SELECTOR;
+        idt[i].type = IDT_INTERRUPT_GATE;
+        idt[i].offset_mid = (stub >> 16) & 0xffff;
+        idt[i].offset_high = stub >> 32;
+    }
+    asm volatile("lidt %0" : : "m"(idtr));
+
+    lapic_write(LAPIC_SVR, LAPIC_SVR_ENABLE | IRQ_SPURIOUS_VECTOR);
+}
+
+void irq_register(int vector, void (*handler)(void *opaque), void *opaque) {
+    irq_handlers[vector - IRQ_VECTOR_BASE].opaque = opaque;
+    irq_handlers[vector - IRQ_VECTOR_BASE].handler = handler;
+}
+
+// called by the entry points with interrupts disabled
+void irq_handle(unsigned long vector) {
+    if (vector == IRQ_SPURIOUS_VECTOR) return;  // no EOI for these
+    if (irq_handlers[vector - IRQ_VECTOR_BASE].handler) {
+        irq_handlers[vector - IRQ_VECTOR_BASE].handler(
+            irq_handlers[vector - IRQ_VECTOR_BASE].opaque);
+    }
+    lapic_write(LAPIC_EOI, 0);
+}
+
+void irq_route(int pin, int vector) {
+    // edge triggered, fixed delivery to this LAPIC
+    ioapic_write(IOAPIC_REDIR(pin) + 1, lapic_read(LAPIC_ID) & 0xff000000);
+    ioapic_write(IOAPIC_REDIR(pin), vector);
+}
+
+// sti only takes effect after the next instruction, an interrupt that became
+// pending before it wakes up the hlt
+void irq_idle(void) {
+    asm volatile("sti; hlt; cli" : : : "memory");
+}
+
+// port of a register of the queue
+#define HDD_REG(d, port) ((d)->base + (port) - HDD_SECTOR_PORT)
+
+int hdd_setup(struct hdd_dev *d, int disk, int queue) {
+    d->base = HDD_PORT(disk, queue);
+    d->disk = disk;
+    d->irq = 0;
+    d->ring = NULL;
+    d->cache.capacity = 0;
+    d->status.err = 1;
+    outl(OFF32(&d->status), HDD_REG(d, HDD_DMA_ADDR_PORT));
+    outb(HDD_CMD_SETUP, HDD_REG(d, HDD_CMD_PORT));
+    return d->status.err;  // device will set to 0 when correctly setup
 }
 
-static int hdd_read_sector_full(volatile struct hdd_status *h, int sector,
-                                char *buf) {
-    outl(sector, HDD_SECTOR_PORT);
-    outl(OFF32(buf), HDD_DMA_ADDR_PORT);
-    outb(HDD_CMD_READ, HDD_CMD_PORT);
-    if (h->err)
-        return -h->err;
+// returns 1 when running again from the saved snapshot
+int snapshot(void) {
+    outl(1, SNAPSHOT_PORT);
+    return inl(SNAPSHOT_PORT);
+}
+
+// the device registers can be read back
+int hdd_get_sector(struct hdd_dev *d) {
+    return inl(HDD_REG(d, HDD_SECTOR_PORT));
+}
+
+static int hdd_read_sector_full(struct hdd_dev *d, int sector, char *buf) {
+    outl(sector, HDD_REG(d, HDD_SECTOR_PORT));
+    outl(OFF32(buf), HDD_REG(d, HDD_DMA_ADDR_PORT));
+    outb(HDD_CMD_READ, HDD_REG(d, HDD_CMD_PORT));
+    if (d->status.err)
+        return -d->status.err;
     else
         return HDD_SECTOR_SIZE;
 }
 
-static int hdd_read_sector_part(volatile struct hdd_status *h, int sector,
+// reads count contiguous sectors with a single command
+static int hdd_read_sectors(struct hdd_dev *d, int sector,
+                            char *buf, unsigned count) {
+    if (count == 1) return hdd_read_sector_full(d, sector, buf);
+
+    outl(count, HDD_REG(d, HDD_COUNT_PORT));
+    outl(sector, HDD_REG(d, HDD_SECTOR_PORT));
+    outl(OFF32(buf), HDD_REG(d, HDD_DMA_ADDR_PORT));
+    outb(HDD_CMD_READ, HDD_REG(d, HDD_CMD_PORT));
+    if (d->status.err)
+        return -d->status.err;
+    else
+        return count * HDD_SECTOR_SIZE;
+}
+
+static int hdd_write_sector_full(struct hdd_dev *d, int sector,
+                                 const char *buf);
+
+int hdd_cache_init(struct hdd_dev *d, unsigned capacity) {
+    d->cache.entries = malloc(capacity * sizeof(struct hdd_cache_entry));
+    for (unsigned i = 0; i < capacity; i++) {
+        d->cache.entries[i].sector = -1;
+        d->cache.entries[i].dirty = 0;
+        d->cache.entries[i].last_used = 0;
+        d->cache.entries[i].data = malloc(HDD_SECTOR_SIZE);
+    }
+    d->cache.capacity = capacity;
+    return 0;
+}
+
+static struct hdd_cache_entry *hdd_cache_find(struct hdd_dev *d, int sector) {
+    for (unsigned i = 0; i < d->cache.capacity; i++) {
+        if (d->cache.entries[i].sector == sector) return &d->cache.entries[i];
+    }
+    return NULL;
+}
+
+static int hdd_cache_writeback(struct hdd_dev *d, struct hdd_cache_entry *e) {
+    int res;
+
+    if (!e->dirty) return 0;
+    res = hdd_write_sector_full(d, e->sector, e->data);
+    if (res < 0) return res;
+    e->dirty = 0;
+    return 0;
+}
+
+// returns the entry of the sector, reading it from the disk on a miss
+static int hdd_cache_get(struct hdd_dev *d, int sector,
+                         struct hdd_cache_entry **entry) {
+    struct hdd_cache_entry *e = hdd_cache_find(d, sector);
+    int res;
+
+    if (e == NULL) {
+        e = &d->cache.entries[0];
+        for (unsigned i = 1; i < d->cache.capacity; i++) {
+            if (d->cache.entries[i].last_used < e->last_used)
+                e = &d->cache.entries[i];
+        }
+
+        res = hdd_cache_writeback(d, e);
+        if (res < 0) return res;
+        e->sector = -1;
+        res = hdd_read_sector_full(d, sector, e->data);
+        if (res < 0) return res;
+        e->sector = sector;
+    }
+
+    e->last_used = ++d->cache.tick;
+    *entry = e;
+    return 0;
+}
+
+// the cache is newer than the disk for the dirty sectors
+static void hdd_cache_read_overlay(struct hdd_dev *d, int sector, char *buf,
+                                   unsigned count) {
+    struct hdd_cache_entry *e;
+
+    for (unsigned i = 0; i < d->cache.capacity; i++) {
+        e = &d->cache.entries[i];
+        if (e->dirty && e->sector >= sector &&
+            e->sector < sector + (int)count) {
+            memcpy(buf + (e->sector - sector) * HDD_SECTOR_SIZE, e->data,
+                   HDD_SECTOR_SIZE);
+        }
+    }
+}
+
+// sectors written to the disk directly are up to date in the cache too
+static void hdd_cache_write_update(struct hdd_dev *d, int sector,
+                                   const char *buf, unsigned count) {
+    struct hdd_cache_entry *e;
+
+    for (unsigned i = 0; i < d->cache.capacity; i++) {
+        e = &d->cache.entries[i];
+        if (e->sector >= sector && e->sector < sector + (int)count) {
+            memcpy(e->data, buf + (e->sector - sector) * HDD_SECTOR_SIZE,
+                   HDD_SECTOR_SIZE);
+            e->dirty = 0;
+        }
+    }
+}
+
+// writes back the cache, then asks the device to make all the writes durable
+int hdd_flush(struct hdd_dev *d) {
+    int res;
+
+    for (unsigned i = 0; i < d->cache.capacity; i++) {
+        if (d->cache.entries[i].sector < 0) continue;
+        res = hdd_cache_writeback(d, &d->cache.entries[i]);
+        if (res < 0) return res;
+    }
+
+    outb(HDD_CMD_FLUSH, HDD_REG(d, HDD_CMD_PORT));
+    return -d->status.err;
+}
+
+static int hdd_read_sector_part(struct hdd_dev *d, int sector,
                                 int sector_off, char *buf, unsigned size) {
     char sector_buf[HDD_SECTOR_SIZE];
+    struct hdd_cache_entry *e;
     int res;
 
-    res = hdd_read_sector_full(h, sector, sector_buf);
+    if (d->cache.capacity) {
+        res = hdd_cache_get(d, sector, &e);
+        if (res < 0) return res;
+
+        memcpy(buf, e->data + sector_off, size);
+        return size;
+    }
+
+    res = hdd_read_sector_full(d, sector, sector_buf);
     if (res < 0) return res;
 
     memcpy(buf, sector_buf + sector_off, size);
     return size;
 }
 
-int hdd_read(volatile struct hdd_status *h, int offset, char *buf,
-             unsigned size) {
+int hdd_read(struct hdd_dev *d, int offset, char *buf, unsigned size) {
     unsigned bytes_read = 0, read_size;
     int res, sector, sector_off;
 
@@ -120,9 +447,15 @@ int hdd_read(volatile struct hdd_status *h, int offset, char *buf,
         read_size = min(size - bytes_read, HDD_SECTOR_SIZE - sector_off);
 
         if (sector_off == 0 && read_size == HDD_SECTOR_SIZE) {
-            res = hdd_read_sector_full(h, sector, buf);
+            // read the whole aligned middle of the request at once
+            read_size = (size - bytes_read) & ~(HDD_SECTOR_SIZE - 1);
+            res = hdd_read_sectors(d, sector, buf,
+                                   read_size / HDD_SECTOR_SIZE);
+            if (res >= 0)
+                hdd_cache_read_overlay(d, sector, buf,
+                                       read_size / HDD_SECTOR_SIZE);
         } else {
-            res = hdd_read_sector_part(h, sector, sector_off, buf, read_size);
+            res = hdd_read_sector_part(d, sector, sector_off, buf, read_size);
         }
         if (res < 0) {
             return res;
@@ -135,36 +468,61 @@ int hdd_read(volatile struct hdd_status *h, int offset, char *buf,
     return bytes_read;
 }
 
-static int hdd_write_sector_full(volatile struct hdd_status *h, int sector,
+static int hdd_write_sector_full(struct hdd_dev *d, int sector,
                                  const char *buf) {
-    outl(sector, HDD_SECTOR_PORT);
-    outl(OFF32(buf), HDD_DMA_ADDR_PORT);
-    outb(HDD_CMD_WRITE, HDD_CMD_PORT);
-    if (h->err)
-        return -h->err;
+    outl(sector, HDD_REG(d, HDD_SECTOR_PORT));
+    outl(OFF32(buf), HDD_REG(d, HDD_DMA_ADDR_PORT));
+    outb(HDD_CMD_WRITE, HDD_REG(d, HDD_CMD_PORT));
+    if (d->status.err)
+        return -d->status.err;
     else
         return HDD_SECTOR_SIZE;
 }
 
-static int hdd_write_sector_part(volatile struct hdd_status *h, int sector,
+// writes count contiguous sectors with a single command
+static int hdd_write_sectors(struct hdd_dev *d, int sector,
+                             const char *buf, unsigned count) {
+    if (count == 1) return hdd_write_sector_full(d, sector, buf);
+
+    outl(count, HDD_REG(d, HDD_COUNT_PORT));
+    outl(sector, HDD_REG(d, HDD_SECTOR_PORT));
+    outl(OFF32(buf), HDD_REG(d, HDD_DMA_ADDR_PORT));
+    outb(HDD_CMD_WRITE, HDD_REG(d, HDD_CMD_PORT));
+    if (d->status.err)
+        return -d->status.err;
+    else
+        return count * HDD_SECTOR_SIZE;
+}
+
+static int hdd_write_sector_part(struct hdd_dev *d, int sector,
                                  int sector_off, const char *buf,
                                  unsigned size) {
     char sector_buf[HDD_SECTOR_SIZE];
+    struct hdd_cache_entry *e;
     int res;
 
-    res = hdd_read_sector_full(h, sector, sector_buf);
+    // written back on eviction or flush
+    if (d->cache.capacity) {
+        res = hdd_cache_get(d, sector, &e);
+        if (res < 0) return res;
+
+        memcpy(e->data + sector_off, buf, size);
+        e->dirty = 1;
+        return size;
+    }
+
+    res = hdd_read_sector_full(d, sector, sector_buf);
     if (res < 0) return res;
 
     memcpy(sector_buf + sector_off, buf, size);
 
-    res = hdd_write_sector_full(h, sector, sector_buf);
+    res = hdd_write_sector_full(d, sector, sector_buf);
     if (res < 0) return res;
 
     return size;
 }
 
-int hdd_write(volatile struct hdd_status *h, int offset, const char *buf,
-              unsigned size) {
+int hdd_write(struct hdd_dev *d, int offset, const char *buf, unsigned size) {
     unsigned bytes_written = 0, write_size;
     int res, sector, sector_off;
 
@@ -174,9 +532,15 @@ int hdd_write(volatile struct hdd_status *h, int offset, const char *buf,
         write_size = min(size - bytes_written, HDD_SECTOR_SIZE - sector_off);
 
         if (sector_off == 0 && write_size == HDD_SECTOR_SIZE) {
-            res = hdd_write_sector_full(h, sector, buf);
+            // write the whole aligned middle of the request at once
+            write_size = (size - bytes_written) & ~(HDD_SECTOR_SIZE - 1);
+            res = hdd_write_sectors(d, sector, buf,
+                                    write_size / HDD_SECTOR_SIZE);
+            if (res >= 0)
+                hdd_cache_write_update(d, sector, buf,
+                                       write_size / HDD_SECTOR_SIZE);
         } else {
-            res = hdd_write_sector_part(h, sector, sector_off, buf, write_size);
+            res = hdd_write_sector_part(d, sector, sector_off, buf, write_size);
         }
         if (res < 0) {
             return res;
@@ -188,3 +552,177 @@ int hdd_write(volatile struct hdd_status *h, int offset, const char *buf,
 
     return bytes_written;
 }
+
+int hdd_ring_setup(struct hdd_dev *d, volatile struct hdd_ring *ring) {
+    d->ring = ring;
+    d->reaped = 0;
+    ring->head = 0;
+    ring->tail = 0;
+    d->status.err = 1;
+    outl(OFF32(ring), HDD_REG(d, HDD_DMA_ADDR_PORT));
+    outb(HDD_CMD_RING_SETUP, HDD_REG(d, HDD_CMD_PORT));
+    return d->status.err;  // device will set to 0 when correctly setup
+}
+
+// posts a request on the ring without notifying the device, returns the slot
+// of the descriptor
+int hdd_ring_add(struct hdd_dev *d, int cmd, int sector, char *buf) {
+    volatile struct hdd_ring *ring = d->ring;
+    volatile struct hdd_desc *desc;
+    unsigned int head = ring->head;
+
+    if (head - ring->tail >= HDD_RING_SIZE) return -EAGAIN;
+
+    desc = &ring->desc[head & (HDD_RING_SIZE - 1)];
+    desc->cmd = cmd;
+    desc->sector = sector;
+    desc->guest_addr = OFF32(buf);
+    desc->err = 0;
+    ring->head = head + 1;
+
+    return head & (HDD_RING_SIZE - 1);
+}
+
+// notifies the device of all the posted requests with a single exit and waits
+// for their completion, returns the number of completed requests or the first
+// error
+int hdd_ring_kick(struct hdd_dev *d) {
+    volatile struct hdd_ring *ring = d->ring;
+    unsigned int tail = ring->tail, head = ring->head;
+
+    d->status.err = 0;
+    outb(HDD_CMD_RING_KICK, HDD_REG(d, HDD_CMD_PORT));
+    // the device may complete the requests asynchronously
+    while (ring->tail != head) {
+        if (d->status.err) return -d->status.err;
+        if (d->irq)
+            irq_idle();
+        else
+            asm volatile("pause");
+    }
+
+    for (unsigned int i = tail; i != head; i++) {
+        if (ring->desc[i & (HDD_RING_SIZE - 1)].err)
+            return -ring->desc[i & (HDD_RING_SIZE - 1)].err;
+    }
+
+    return head - tail;
+}
+
+static int hdd_ring_rw(struct hdd_dev *d, int cmd, int sector, char *buf,
+                       unsigned count) {
+    unsigned done = 0;
+    int res;
+
+    while (done < count) {
+        while (done < count &&
+               hdd_ring_add(d, cmd, sector + done,
+                            buf + done * HDD_SECTOR_SIZE) >= 0) {
+            done++;
+        }
+
+        res = hdd_ring_kick(d);
+        if (res < 0) return res;
+    }
+
+    return done * HDD_SECTOR_SIZE;
+}
+
+int hdd_ring_read(struct hdd_dev *d, int sector, char *buf, unsigned count) {
+    return hdd_ring_rw(d, HDD_CMD_READ, sector, buf, count);
+}
+
+int hdd_ring_write(struct hdd_dev *d, int sector, const char *buf,
+                   unsigned count) {
+    return hdd_ring_rw(d, HDD_CMD_WRITE, sector, (char *)buf, count);
+}
+
+// the descriptors of the requests stay untouched until reaped, so that their
+// err field can still be read after the device advanced tail
+int hdd_submit(struct hdd_dev *d, struct hdd_request *req) {
+    volatile struct hdd_ring *ring = d->ring;
+    int slot;
+
+    if (ring->head - d->reaped >= HDD_RING_SIZE) return -EAGAIN;
+
+    slot = hdd_ring_add(d, req->cmd, req->sector, req->buf);
+    if (slot < 0) return slot;
+    req->done = 0;
+    d->inflight[slot] = req;
+    outb(HDD_CMD_RING_KICK, HDD_REG(d, HDD_CMD_PORT));
+    return 0;
+}
+
+// tail is advanced after the err fields of the batch are set
+int hdd_poll(struct hdd_dev *d) {
+    volatile struct hdd_ring *ring = d->ring;
+    unsigned int tail = ring->tail;
+    struct hdd_request *req;
+    int n = 0;
+
+    for (; d->reaped != tail; d->reaped++, n++) {
+        req = d->inflight[d->reaped & (HDD_RING_SIZE - 1)];
+        req->res = -ring->desc[d->reaped & (HDD_RING_SIZE - 1)].err;
+        req->done = 1;
+        if (req->callback) req->callback(req, req->opaque);
+    }
+
+    return n;
+}
+
+int hdd_wait(struct hdd_dev *d, struct hdd_request *req) {
+    while (!req->done) {
+        if (hdd_poll(d)) continue;
+        if (d->irq)
+            irq_idle();
+        else
+            asm volatile("pause");
+    }
+
+    return req->res;
+}
+
+// the completion of a ring kick raises the interrupt even if nobody waits for
+// it, so there is nothing to do but wake up
+int hdd_irq_enable(struct hdd_dev *d) {
+    irq_route(HDD_IRQ(d->disk), HDD_IRQ_VECTOR(d->disk));
+    d->irq = 1;
+    return 0;
+}
+
+// NULL if the disk is not mapped
+char *hdd_dax(struct hdd_dev *d) {
+    return d->status.dax_size ? (char *)HDD_DAX_ADDR(d->disk) : NULL;
+}
+
+static int hdd_dax_check(struct hdd_dev *d, unsigned long offset,
+                         unsigned size) {
+    return offset <= d->status.dax_size && size <= d->status.dax_size - offset;
+}
+
+int hdd_dax_read(struct hdd_dev *d, unsigned long offset, char *buf,
+                 unsigned size) {
+    if (!hdd_dax_check(d, offset, size)) return -EINVAL;
+    memcpy(buf, hdd_dax(d) + offset, size);
+    return size;
+}
+
+int hdd_dax_write(struct hdd_dev *d, unsigned long offset, const char *buf,
+                  unsigned size) {
+    if (!hdd_dax_check(d, offset, size)) return -EINVAL;
+    memcpy(hdd_dax(d) + offset, buf, size);
+    return size;
+}
+
+// writes back the sectors covering [offset, offset + size)
+int hdd_dax_flush(struct hdd_dev *d, unsigned long offset, unsigned size) {
+    unsigned long first = offset / HDD_SECTOR_SIZE;
+    unsigned long last =
+        (offset + size + HDD_SECTOR_SIZE - 1) / HDD_SECTOR_SIZE;
+
+    if (!hdd_dax_check(d, offset, size) || size == 0) return -EINVAL;
+    outl(last - first, HDD_REG(d, HDD_COUNT_PORT));
+    outl(first, HDD_REG(d, HDD_SECTOR_PORT));
+    outb(HDD_CMD_DAX_FLUSH, HDD_REG(d, HDD_CMD_PORT));
+    return -d->status.err;
+}
@@ -7,14 +7,129 @@
 
 extern void memcpy(char *dest, const char *src, unsigned size);
 extern void memset(char *buf, char c, unsigned size);
+extern int memcmp(const char *a, const char *b, unsigned size);
 extern void *malloc(unsigned size);
 
 extern void putc(char c);
 extern void puts(const char *s);
+extern void write(const char *buf, unsigned size);
 extern void puti(int i);
+extern void putu(unsigned long u);
 
-extern int hdd_setup(volatile struct hdd_status *h);
-extern int hdd_read(volatile struct hdd_status *h, int offset, char *buf,
-                    unsigned size);
-extern int hdd_write(volatile struct hdd_status *h, int offset, const char *buf,
+extern int snapshot(void);
+
+// interrupts go through the LAPIC of each vCPU, which irq_init enables after
+// loading the IDT. The vectors from IRQ_VECTOR_BASE on can have a handler,
+// which runs with interrupts disabled and is followed by the EOI. Interrupts
+// are only enabled while waiting in irq_idle.
+#define IRQ_VECTOR_BASE 32
+#define IRQ_VECTORS 32
+#define IRQ_SPURIOUS_VECTOR (IRQ_VECTOR_BASE + IRQ_VECTORS - 1)
+#define IRQ_TIMER_VECTOR IRQ_VECTOR_BASE
+#define HDD_IRQ_VECTOR(disk) (IRQ_VECTOR_BASE + 1 + (disk))
+
+extern void irq_init(void);
+extern void irq_register(int vector, void (*handler)(void *opaque),
+                         void *opaque);
+// sends an IOAPIC pin to this vCPU. The IOAPIC is shared: only one vCPU at a
+// time may route pins.
+extern void irq_route(int pin, int vector);
+extern void irq_idle(void);
+#define LAPIC_LVT_TIMER 0x320
+#define LAPIC_TIMER_INITIAL 0x380
+#define LAPIC_TIMER_DIVIDE 0x3e0
+#define LAPIC_TIMER_DIVIDE_1 0xb
+
+extern unsigned int lapic_read(unsigned int reg);
+extern void lapic_write(unsigned int reg, unsigned int val);
+
+// write-back cache of the sectors accessed partially, the least recently used
+// sector is evicted when it is full
+struct hdd_cache_entry {
+    int sector;  // -1 if the entry is free
+    int dirty;
+    unsigned long last_used;
+    char *data;
+};
+
+struct hdd_cache {
+    struct hdd_cache_entry *entries;
+    unsigned capacity;
+    unsigned long tick;
+};
+
+struct hdd_request;
+
+// a queue of a disk, set up by hdd_setup. Queues are independent: each one
+// can be used by a different vCPU without locking.
+struct hdd_dev {
+    ioport base;  // port of the first register
+    int disk;
+    int irq;  // hdd_ring_kick waits for the interrupt instead of spinning
+    volatile struct hdd_status status;
+    volatile struct hdd_ring *ring;
+    struct hdd_cache cache;
+    // requests of hdd_submit by slot, the ones before reaped are completed
+    struct hdd_request *inflight[HDD_RING_SIZE];
+    unsigned int reaped;
+};
+
+extern int hdd_setup(struct hdd_dev *d, int disk, int queue);
+extern int hdd_get_sector(struct hdd_dev *d);
+
+// caches capacity sectors accessed partially by hdd_read and hdd_write, the
+// writes reach the disk when evicted or with hdd_flush. The cache belongs to
+// the queue: other queues and the ring bypass it. hdd_flush also makes the
+// writes durable, even without a cache.
+extern int hdd_cache_init(struct hdd_dev *d, unsigned capacity);
+extern int hdd_flush(struct hdd_dev *d);
+extern int hdd_read(struct hdd_dev *d, int offset, char *buf, unsigned size);
+extern int hdd_write(struct hdd_dev *d, int offset, const char *buf,
                      unsigned size);
+
+extern int hdd_ring_setup(struct hdd_dev *d, volatile struct hdd_ring *ring);
+extern int hdd_ring_add(struct hdd_dev *d, int cmd, int sector, char *buf);
+extern int hdd_ring_kick(struct hdd_dev *d);
+// the interrupt of the disk goes to this vCPU, which must have called irq_init
+extern int hdd_irq_enable(struct hdd_dev *d);
+extern int hdd_ring_read(struct hdd_dev *d, int sector, char *buf,
+                         unsigned count);
+extern int hdd_ring_write(struct hdd_dev *d, int sector, const char *buf,
+                          unsigned count);
+
+// a request of a sector on the ring that completes in the background. The
+// caller owns it until done is set; callback, if not NULL, is then called
+// from hdd_poll or hdd_wait with res 0 or the negated error.
+struct hdd_request {
+    // HDD_CMD_READ, HDD_CMD_WRITE (maybe | HDD_CMD_FUA) or HDD_CMD_FLUSH
+    int cmd;
+    int sector;
+    char *buf;
+    void (*callback)(struct hdd_request *req, void *opaque);
+    void *opaque;
+    volatile int done;
+    int res;
+};
+
+// posts req and kicks the ring without waiting, returns -EAGAIN if the ring
+// has no free slot (completed requests free theirs once reaped). With
+// --async-hdd the device processes the ring while the guest keeps running.
+// These calls own the ring: do not mix them with hdd_ring_kick on a queue.
+extern int hdd_submit(struct hdd_dev *d, struct hdd_request *req);
+// completes the requests whose descriptors the device consumed, returns how
+// many
+extern int hdd_poll(struct hdd_dev *d);
+// polls until req is done, returns its res
+extern int hdd_wait(struct hdd_dev *d, struct hdd_request *req);
+
+// with --dax the first status.dax_size bytes of the disk are mapped at
+// HDD_DAX_ADDR(disk): reads and writes are plain loads and stores, which
+// neither exit nor copy. The writes are durable after hdd_dax_flush. The
+// window bypasses the sector cache, like the ring.
+extern char *hdd_dax(struct hdd_dev *d);
+extern int hdd_dax_read(struct hdd_dev *d, unsigned long offset, char *buf,
+                        unsigned size);
+extern int hdd_dax_write(struct hdd_dev *d, unsigned long offset,
+                         const char *buf, unsigned size);
+extern int hdd_dax_flush(struct hdd_dev *d, unsigned long offset,
+                         unsigned size);
@@ -3,4 +3,47 @@ _guest_start:
 	call main
 	movq %cr0, %rdx
     smswl %eax
-	hlt
+	# EXIT_PORT, HLT would only wait for an interrupt
+	outb %al, $0x31
+
+# interrupt entry points, 8 bytes each, for the vectors from IRQ_VECTOR_BASE
+# (32) on. They push the vector and call irq_handle(vector) with the
+# registers it may clobber saved.
+.extern irq_handle
+.globl irq_stubs
+.align 8
+irq_stubs:
+.irp vector, 32, 33, 34, 35, 36, 37, 38, 39, 40, 41, 42, 43, 44, 45, 46, 47, 48, 49, 50, 51, 52, 53, 54, 55, 56, 57, 58, 59, 60, 61, 62, 63
+	.align 8
+	pushq $\vector
+	jmp irq_common
+.endr
+
+irq_common:
+	pushq %rax
+	pushq %rcx
+	pushq %rdx
+	pushq %rsi
+	pushq %rdi
+	pushq %r8
+	pushq %r9
+	pushq %r10
+	pushq %r11
+	# the CPU aligned the stack before the frame and the vector, keep it
+	# aligned for the call
+	subq $8, %rsp
+	movq 80(%rsp), %rdi
+	cld
+	call irq_handle
+	addq $8, %rsp
+	popq %r11
+	popq %r10
+	popq %r9
+	popq %r8
+	popq %rdi
+	popq %rsi
+	popq %rdx
+	popq %rcx
+	popq %rax
+	addq $8, %rsp
+	iretq
@@ -0,0 +1,331 @@
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "host_io.h"
+
+#define COW_MAGIC "KVMCOW1"
+#define COW_HEADER_SIZE 4096
+#define COW_CLUSTER_BITS 16
+#define COW_CLUSTER_SIZE (1ul << COW_CLUSTER_BITS)
+
+// on-disk layout: the header, the cluster map right after it (one entry for
+// each cluster of the disk), then the data clusters in allocation order
+struct cow_header {
+    char magic[8];
+    uint32_t cluster_bits;
+    uint32_t pad;
+    uint64_t size;         // size of the disk, the same as the backing file
+    uint64_t map_offset;   // offset of the cluster map in the overlay
+    uint64_t data_offset;  // offset of the first data cluster
+    char backing[COW_HEADER_SIZE - 40];  // absolute path of the backing file
+};
+
+struct cow {
+    int fd;
+    int backing_fd;
+    uint64_t size;
+    // offset of each cluster in the overlay, 0 if it is still in the backing
+    // file. Read from the overlay at open and kept in private memory: the
+    // entries of new clusters are only written back by cow_commit, once their
+    // data is durable, so that a crash never leaves an entry pointing to a
+    // cluster that was not written.
+    uint64_t *map;
+    size_t map_size;
+    uint64_t map_offset;
+    // clusters allocated since the last cow_commit
+    uint64_t *pending;
+    size_t nr_pending, max_pending;
+    uint64_t next;  // where the next cluster will be allocated
+    char *cluster;  // scratch buffer to copy up partial clusters
+    // serializes the queues, so that clusters are never allocated twice
+    pthread_mutex_t lock;
+};
+
+// creating an overlay only writes its header, the map is a hole in the file
+// that reads as zeros, i.e. "all clusters in the backing file"
+static int cow_create(int fd, const char *backing_fname) {
+    struct cow_header hdr;
+    struct stat st;
+    uint64_t map_size;
+    char *path;
+
+    memset(&hdr, 0, sizeof(hdr));
+    path = realpath(backing_fname, NULL);
+    if (path == NULL) {
+        perror("realpath(backing)");
+        return -1;
+    }
+    if (strlen(path) >= sizeof(hdr.backing)) {
+        fprintf(stderr, "backing file path too long\n");
+        return -1;
+    }
+    strcpy(hdr.backing, path);
+    free(path);
+    if (stat(hdr.backing, &st) < 0) {
+        perror("stat(backing)");
+        return -1;
+    }
+
+    memcpy(hdr.magic, COW_MAGIC, sizeof(hdr.magic));
+    hdr.cluster_bits = COW_CLUSTER_BITS;
+    hdr.size = st.st_size;
+    hdr.map_offset = COW_HEADER_SIZE;
+    map_size = (hdr.size + COW_CLUSTER_SIZE - 1) / COW_CLUSTER_SIZE *
+               sizeof(uint64_t);
+    hdr.data_offset = (hdr.map_offset + map_size + COW_CLUSTER_SIZE - 1) &
+                      ~(COW_CLUSTER_SIZE - 1);
+
+    if (pwrite(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr)) {
+        perror("pwrite(cow header)");
+        return -1;
+    }
+    if (ftruncate(fd, hdr.data_offset) < 0) {
+        perror("ftruncate(cow)");
+        return -1;
+    }
+
+    return 0;
+}
+
+static int cow_open(struct cow *c, int fd) {
+    struct cow_header hdr;
+    struct stat st;
+    size_t map_size;
+
+    if (pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+        memcmp(hdr.magic, COW_MAGIC, sizeof(hdr.magic)) != 0 ||
+        hdr.cluster_bits != COW_CLUSTER_BITS) {
+        fprintf(stderr, "not a copy-on-write overlay\n");
+        return -1;
+    }
+    hdr.backing[sizeof(hdr.backing) - 1] = '\0';
+    printf("\t\t- Backing file %s\n", hdr.backing);
+
+    c->backing_fd = open(hdr.backing, O_RDONLY | O_CLOEXEC);
+    if (c->backing_fd < 0) {
+        perror("Cannot open backing file");
+        return -1;
+    }
+    if (fstat(c->backing_fd, &st) < 0) {
+        perror("fstat(backing)");
+        return -1;
+    }
+    if ((uint64_t)st.st_size != hdr.size) {
+        fprintf(stderr, "backing file changed size since the overlay was "
+                        "created\n");
+        return -1;
+    }
+
+    map_size = (hdr.size + COW_CLUSTER_SIZE - 1) / COW_CLUSTER_SIZE *
+               sizeof(uint64_t);
+    c->map = malloc(map_size);
+    if (c->map == NULL) {
+        perror("malloc(cow map)");
+        return -1;
+    }
+    if (pread(fd, c->map, map_size, hdr.map_offset) != (ssize_t)map_size) {
+        perror("pread(cow map)");
+        return -1;
+    }
+
+    if (fstat(fd, &st) < 0) {
+        perror("fstat(cow)");
+        return -1;
+    }
+    c->next = (st.st_size + COW_CLUSTER_SIZE - 1) & ~(COW_CLUSTER_SIZE - 1);
+    if (c->next < hdr.data_offset) c->next = hdr.data_offset;
+
+    c->fd = fd;
+    c->size = hdr.size;
+    c->map_size = map_size;
+    c->map_offset = hdr.map_offset;
+    return 0;
+}
+
+// copies the cluster from the backing file to a new cluster of the overlay
+static int cow_copy_up(struct cow *c, uint64_t idx) {
+    uint64_t off = idx << COW_CLUSTER_BITS;
+    size_t len = c->size - off < COW_CLUSTER_SIZE ? c->size - off
+                                                  : COW_CLUSTER_SIZE;
+
+    memset(c->cluster, 0, COW_CLUSTER_SIZE);
+    if (pread(c->backing_fd, c->cluster, len, off) != (ssize_t)len) {
+        return EIO;
+    }
+    if (pwrite(c->fd, c->cluster, COW_CLUSTER_SIZE, c->next) !=
+        COW_CLUSTER_SIZE) {
+        return EIO;
+    }
+
+    // the entry is used right away, but only reaches the overlay in
+    // cow_commit
+    if (c->nr_pending == c->max_pending) {
+        size_t max = c->max_pending ? 2 * c->max_pending : 64;
+        uint64_t *p = realloc(c->pending, max * sizeof(*p));
+
+        if (p == NULL) return EIO;
+        c->pending = p;
+        c->max_pending = max;
+    }
+    c->pending[c->nr_pending++] = idx;
+    c->map[idx] = c->next;
+    c->next += COW_CLUSTER_SIZE;
+    return 0;
+}
+
+// makes the clusters allocated since the last commit durable, then writes
+// their map entries. The entries themselves are durable after the next
+// fdatasync; until then a crash only loses the new clusters.
+static int cow_commit(struct cow *c) {
+    uint64_t idx;
+
+    if (c->nr_pending == 0) return 0;
+    if (fdatasync(c->fd) < 0) {
+        perror("fdatasync(cow)");
+        return EIO;
+    }
+    for (size_t i = 0; i < c->nr_pending; i++) {
+        idx = c->pending[i];
+        if (pwrite(c->fd, &c->map[idx], sizeof(c->map[idx]),
+                   c->map_offset + idx * sizeof(c->map[idx])) !=
+            sizeof(c->map[idx])) {
+            perror("pwrite(cow map)");
+            return EIO;
+        }
+    }
+    c->nr_pending = 0;
+    return 0;
+}
+
+static int cow_rw(struct cow *c, struct hdd_req *req) {
+    char *buf = req->buf;
+    size_t off = req->off, done = 0, len;
+    uint64_t idx, in;
+    ssize_t res;
+    int err;
+
+    while (done < req->len) {
+        idx = off >> COW_CLUSTER_BITS;
+        in = off & (COW_CLUSTER_SIZE - 1);
+        len = req->len - done < COW_CLUSTER_SIZE - in ? req->len - done
+                                                      : COW_CLUSTER_SIZE - in;
+
+        if (req->cmd == HDD_CMD_READ) {
+            if (c->map[idx]) {
+                res = pread(c->fd, buf, len, c->map[idx] + in);
+            } else {
+                res = pread(c->backing_fd, buf, len, off);
+            }
+        } else {
+            if (!c->map[idx]) {
+                err = cow_copy_up(c, idx);
+                if (err) return err;
+            }
+            res = pwrite(c->fd, buf, len, c->map[idx] + in);
+        }
+        if (res != (ssize_t)len) return EIO;
+
+        done += len;
+        off += len;
+        buf += len;
+    }
+
+    return 0;
+}
+
+// the backing file is never written, only the overlay needs to be synced:
+// the data first (in cow_commit), then the map entries that point to it. A
+// crash in between only loses the new clusters, which no entry refers to.
+static int cow_sync(struct cow *c) {
+    int err = cow_commit(c);
+
+    if (err) return err;
+    if (fdatasync(c->fd) < 0) {
+        perror("fdatasync(cow)");
+        return EIO;
+    }
+    return 0;
+}
+
+static void hdd_cow_submit(struct hdd *hdd, int queue, struct hdd_req *reqs,
+                           unsigned int n) {
+    struct cow *c = hdd->backend_data;
+
+    (void)queue;
+
+    pthread_mutex_lock(&c->lock);
+    for (unsigned int i = 0; i < n; i++) {
+        if (reqs[i].cmd == HDD_CMD_FLUSH) {
+            reqs[i].err = cow_sync(c);
+            continue;
+        }
+        reqs[i].err = cow_rw(c, &reqs[i]);
+        if (reqs[i].err == 0 && reqs[i].fua) {
+            reqs[i].err = cow_sync(c);
+        }
+    }
+    // one fdatasync for all the clusters allocated by the batch. Without it
+    // the writes are lost, the batch fails.
+    if (cow_commit(c)) {
+        for (unsigned int i = 0; i < n; i++) {
+            if (reqs[i].cmd == HDD_CMD_WRITE) reqs[i].err = EIO;
+        }
+    }
+    pthread_mutex_unlock(&c->lock);
+}
+
+static const struct hdd_backend hdd_cow_backend = {
+    .name = "cow",
+    .submit = hdd_cow_submit,
+};
+
+int hdd_cow_setup(struct hdd *hdd, const char *fname,
+                  const char *backing_fname) {
+    struct cow *c;
+    struct stat st;
+    int fd;
+
+    c = calloc(1, sizeof(struct cow));
+    if (c == NULL) {
+        perror("malloc(cow)");
+        return -1;
+    }
+    c->cluster = malloc(COW_CLUSTER_SIZE);
+    if (c->cluster == NULL) {
+        perror("malloc(cow cluster)");
+        return -1;
+    }
+    pthread_mutex_init(&c->lock, NULL);
+
+    fd = open(fname, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        perror("Cannot open file");
+        return -1;
+    }
+    if (fstat(fd, &st) < 0) {
+        perror("fstat");
+        return -1;
+    }
+    if (st.st_size == 0) {
+        printf("\t\t- Creating overlay on top of %s\n", backing_fname);
+        if (cow_create(fd, backing_fname) < 0) {
+            return -1;
+        }
+    }
+    if (cow_open(c, fd) < 0) {
+        return -1;
+    }
+
+    hdd->backend = &hdd_cow_backend;
+    hdd->backend_data = c;
+    hdd->size = c->size;
+
+    return 0;
+}
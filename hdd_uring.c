@@ -0,0 +1,353 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "host_io.h"
+
+// O_DIRECT buffers must be aligned to the logical block size
+#define DIRECT_ALIGN HDD_SECTOR_SIZE
+
+// the largest buffer that io_uring accepts, the guest memory is registered as
+// consecutive buffers of this size
+#define FIXED_BUF_SIZE (1ul << 30)
+
+#define FIXED_UNREGISTERED 0
+#define FIXED_REGISTERED 1
+#define FIXED_FAILED 2
+
+// one for each queue of the disk, sharing the file descriptor of the disk
+struct uring {
+    int fd;
+    int disk_fd;
+    int direct;
+    // the guest memory is buffers 0, 1... of a sparse table. Registering pins
+    // (and allocates) the memory, so each buffer is only registered when a
+    // request first uses it.
+    int fixed;  // the table is set up
+    char *fixed_addr;
+    size_t fixed_size;
+    char *fixed_state;  // FIXED_* of each buffer
+
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+
+    // bounce buffers for O_DIRECT requests on unaligned guest buffers
+    void *bounce[HDD_RING_SIZE];
+};
+
+static int io_uring_setup(unsigned entries, struct io_uring_params *p) {
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+                          unsigned flags) {
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+                   NULL, 0);
+}
+
+static int io_uring_register(int fd, unsigned opcode, void *arg,
+                             unsigned nr_args) {
+    return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static int uring_map(struct uring *u, struct io_uring_params *p) {
+    size_t sq_size, cq_size;
+    void *sq, *cq;
+
+    sq_size = p->sq_off.array + p->sq_entries * sizeof(unsigned);
+    cq_size = p->cq_off.cqes + p->cq_entries * sizeof(struct io_uring_cqe);
+    if (p->features & IORING_FEAT_SINGLE_MMAP) {
+        if (cq_size > sq_size) sq_size = cq_size;
+    }
+
+    sq = mmap(NULL, sq_size, PROT_READ | PROT_WRITE,
+              MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+    if (sq == MAP_FAILED) {
+        perror("mmap(IORING_OFF_SQ_RING)");
+        return -1;
+    }
+
+    if (p->features & IORING_FEAT_SINGLE_MMAP) {
+        cq = sq;
+    } else {
+        cq = mmap(NULL, cq_size, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+        if (cq == MAP_FAILED) {
+            perror("mmap(IORING_OFF_CQ_RING)");
+            return -1;
+        }
+    }
+
+    u->sqes = mmap(NULL, p->sq_entries * sizeof(struct io_uring_sqe),
+                   PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd,
+                   IORING_OFF_SQES);
+    if (u->sqes == MAP_FAILED) {
+        perror("mmap(IORING_OFF_SQES)");
+        return -1;
+    }
+
+    u->sq_head = sq + p->sq_off.head;
+    u->sq_tail = sq + p->sq_off.tail;
+    u->sq_mask = sq + p->sq_off.ring_mask;
+    u->sq_array = sq + p->sq_off.array;
+    u->cq_head = cq + p->cq_off.head;
+    u->cq_tail = cq + p->cq_off.tail;
+    u->cq_mask = cq + p->cq_off.ring_mask;
+    u->cqes = cq + p->cq_off.cqes;
+
+    return 0;
+}
+
+// returns 1 if the buffer idx can be used, registering it the first time
+static int uring_fixed_buf(struct uring *u, unsigned int idx) {
+    struct io_uring_rsrc_update2 up;
+    struct iovec iov;
+    size_t off = idx * FIXED_BUF_SIZE;
+
+    if (u->fixed_state[idx] == FIXED_UNREGISTERED) {
+        iov.iov_base = u->fixed_addr + off;
+        iov.iov_len = u->fixed_size - off < FIXED_BUF_SIZE ? u->fixed_size - off
+                                                            : FIXED_BUF_SIZE;
+        memset(&up, 0, sizeof(up));
+        up.offset = idx;
+        up.data = (unsigned long)&iov;
+        up.nr = 1;
+        if (io_uring_register(u->fd, IORING_REGISTER_BUFFERS_UPDATE, &up,
+                              sizeof(up)) < 0) {
+            perror("io_uring_register(IORING_REGISTER_BUFFERS_UPDATE)");
+            u->fixed_state[idx] = FIXED_FAILED;
+        } else {
+            u->fixed_state[idx] = FIXED_REGISTERED;
+        }
+    }
+    return u->fixed_state[idx] == FIXED_REGISTERED;
+}
+
+static void uring_prep(struct uring *u, struct io_uring_sqe *sqe,
+                       struct hdd_req *req, unsigned int i) {
+    void *buf = req->buf;
+    size_t buf_off = (char *)buf - u->fixed_addr;
+    int fixed = u->fixed && (char *)buf >= u->fixed_addr &&
+                (char *)buf + req->len <= u->fixed_addr + u->fixed_size &&
+                req->len > 0 &&
+                buf_off / FIXED_BUF_SIZE ==
+                    (buf_off + req->len - 1) / FIXED_BUF_SIZE &&
+                uring_fixed_buf(u, buf_off / FIXED_BUF_SIZE);
+
+    memset(sqe, 0, sizeof(*sqe));
+
+    // the flush waits for all the requests submitted before it
+    if (req->cmd == HDD_CMD_FLUSH) {
+        sqe->opcode = IORING_OP_FSYNC;
+        sqe->flags = IOSQE_IO_DRAIN;
+        sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+        sqe->fd = u->disk_fd;
+        sqe->user_data = i;
+        return;
+    }
+
+    if (u->direct && ((unsigned long)buf % DIRECT_ALIGN) != 0) {
+        if (posix_memalign(&u->bounce[i], DIRECT_ALIGN, req->len) != 0) {
+            u->bounce[i] = NULL;
+            sqe->opcode = IORING_OP_NOP;
+            sqe->user_data = i;
+            req->err = EIO;
+            return;
+        }
+        if (req->cmd == HDD_CMD_WRITE) {
+            memcpy(u->bounce[i], buf, req->len);
+        }
+        buf = u->bounce[i];
+        fixed = 0;
+    }
+
+    if (req->cmd == HDD_CMD_READ) {
+        sqe->opcode = fixed ? IORING_OP_READ_FIXED : IORING_OP_READ;
+    } else {
+        sqe->opcode = fixed ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+    }
+    sqe->fd = u->disk_fd;
+    sqe->off = req->off;
+    sqe->addr = (unsigned long)buf;
+    sqe->len = req->len;
+    sqe->rw_flags = req->fua ? RWF_DSYNC : 0;
+    sqe->buf_index = fixed ? buf_off / FIXED_BUF_SIZE : 0;
+    sqe->user_data = i;
+}
+
+static void uring_complete(struct uring *u, struct hdd_req *req,
+                           unsigned int i, int res) {
+    if (req->err == 0) {
+        req->err = (res < 0 || (size_t)res != req->len) ? EIO : 0;
+    }
+
+    if (u->bounce[i]) {
+        if (req->cmd == HDD_CMD_READ && req->err == 0) {
+            memcpy(req->buf, u->bounce[i], req->len);
+        }
+        free(u->bounce[i]);
+        u->bounce[i] = NULL;
+    }
+}
+
+static void hdd_uring_submit(struct hdd *hdd, int queue, struct hdd_req *reqs,
+                             unsigned int n) {
+    struct uring *u = (struct uring *)hdd->backend_data + queue;
+    struct io_uring_cqe *cqe;
+    unsigned int tail, head, idx, submitted = 0, done = 0;
+    char completed[HDD_RING_SIZE] = {0};
+    int res;
+
+    tail = *u->sq_tail;
+    for (unsigned int i = 0; i < n; i++) {
+        idx = tail & *u->sq_mask;
+        reqs[i].err = 0;
+        uring_prep(u, &u->sqes[idx], &reqs[i], i);
+        u->sq_array[idx] = idx;
+        tail++;
+    }
+    __atomic_store_n(u->sq_tail, tail, __ATOMIC_RELEASE);
+
+    // the kernel consumes the SQEs in order and may take fewer than asked
+    while (submitted < n) {
+        res = io_uring_enter(u->fd, n - submitted, n - submitted,
+                             IORING_ENTER_GETEVENTS);
+        if (res < 0 && errno == EINTR) continue;
+        if (res <= 0) {
+            perror("io_uring_enter");
+            break;
+        }
+        submitted += res;
+    }
+
+    // the SQEs left in the ring were never seen by the kernel: take them back
+    // so that the next batch does not submit them
+    if (submitted < n) {
+        __atomic_store_n(u->sq_tail, tail - (n - submitted), __ATOMIC_RELEASE);
+        for (unsigned int i = submitted; i < n; i++) {
+            reqs[i].err = EIO;
+            free(u->bounce[i]);
+            u->bounce[i] = NULL;
+        }
+    }
+
+    while (done < submitted) {
+        head = *u->cq_head;
+        if (head == __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE)) {
+            res = io_uring_enter(u->fd, 0, 1, IORING_ENTER_GETEVENTS);
+            if (res < 0 && errno != EINTR) {
+                perror("io_uring_enter");
+                break;
+            }
+            continue;
+        }
+
+        cqe = &u->cqes[head & *u->cq_mask];
+        uring_complete(u, &reqs[cqe->user_data], cqe->user_data, cqe->res);
+        completed[cqe->user_data] = 1;
+        __atomic_store_n(u->cq_head, head + 1, __ATOMIC_RELEASE);
+        done++;
+    }
+
+    // should only happen if the ring itself is broken, the bounce buffers are
+    // leaked since the kernel may still be using them
+    for (unsigned int i = 0; done < submitted && i < submitted; i++) {
+        if (!completed[i]) {
+            reqs[i].err = EIO;
+            u->bounce[i] = NULL;
+        }
+    }
+}
+
+static const struct hdd_backend hdd_uring_backend = {
+    .name = "io_uring",
+    .submit = hdd_uring_submit,
+};
+
+static int uring_queue_setup(struct uring *u, void *guest_mem_addr,
+                             size_t guest_mem_size) {
+    struct io_uring_params p;
+    struct io_uring_rsrc_register reg;
+    unsigned int nr_bufs;
+
+    memset(&p, 0, sizeof(p));
+    u->fd = io_uring_setup(HDD_RING_SIZE, &p);
+    if (u->fd < 0) {
+        perror("io_uring_setup");
+        return -1;
+    }
+    if (uring_map(u, &p) < 0) {
+        return -1;
+    }
+
+    // DMA goes straight to the guest memory, without bouncing through the
+    // page cache when O_DIRECT is set
+    nr_bufs = (guest_mem_size + FIXED_BUF_SIZE - 1) / FIXED_BUF_SIZE;
+    u->fixed_state = calloc(nr_bufs, 1);
+    if (u->fixed_state == NULL) {
+        perror("malloc(fixed buffers)");
+        return -1;
+    }
+    memset(&reg, 0, sizeof(reg));
+    reg.nr = nr_bufs;
+    reg.flags = IORING_RSRC_REGISTER_SPARSE;
+    if (io_uring_register(u->fd, IORING_REGISTER_BUFFERS2, &reg,
+                          sizeof(reg)) < 0) {
+        perror("io_uring_register(IORING_REGISTER_BUFFERS2)");
+        printf("\t\t- Guest memory not registered, using plain reads\n");
+    } else {
+        u->fixed = 1;
+        u->fixed_addr = guest_mem_addr;
+        u->fixed_size = guest_mem_size;
+    }
+
+    return 0;
+}
+
+int hdd_uring_setup(struct hdd *hdd, const char *fname, int direct,
+                    void *guest_mem_addr, size_t guest_mem_size) {
+    struct uring *u;
+    struct stat st;
+    int disk_fd;
+
+    u = calloc(HDD_MAX_QUEUES, sizeof(struct uring));
+    if (u == NULL) {
+        perror("MAlloc(uring)");
+        return -1;
+    }
+
+    disk_fd = open(fname, O_RDWR | O_CLOEXEC | (direct ? O_DIRECT : 0));
+    if (disk_fd < 0) {
+        perror("Cannot open file");
+        return -1;
+    }
+    if (fstat(disk_fd, &st) < 0) {
+        perror("fstat");
+        return -1;
+    }
+
+    for (int i = 0; i < HDD_MAX_QUEUES; i++) {
+        u[i].disk_fd = disk_fd;
+        u[i].direct = direct;
+        if (uring_queue_setup(&u[i], guest_mem_addr, guest_mem_size) < 0) {
+            return -1;
+        }
+    }
+
+    hdd->backend = &hdd_uring_backend;
+    hdd->backend_data = u;
+    hdd->size = st.st_size;
+
+    return 0;
+}
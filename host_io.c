@@ -1,104 +1,756 @@
 #include "host_io.h"
+#include "trace.h"
 
 #include <linux/kvm.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
 
-int handle_serial(struct kvm_run *r) {
-    char *data = (char *)r + r->io.data_offset;
+// writes left in the coalesced ring are printed at least this often
+#define SERIAL_FLUSH_INTERVAL_NS 10000000
 
-    if (r->io.direction != KVM_EXIT_IO_OUT) return -1;
-
-    for (unsigned i = 0; i < r->io.size * r->io.count; i++)
-        putc(data[i], stdout);
+// writes back the pages of the image covering [off, off + len)
+static int hdd_mmap_sync(struct hdd *hdd, size_t off, size_t len) {
+    size_t page_size = sysconf(_SC_PAGESIZE);
+    size_t start = off & ~(page_size - 1);
 
+    if (msync(hdd->disk_addr + start, off + len - start, MS_SYNC) < 0) {
+        perror("msync");
+        return EIO;
+    }
     return 0;
 }
 
-static int handle_hdd_cmd(struct hdd *hdd, struct kvm_run *r,
-                          void *guest_mem_addr, size_t guest_mem_size) {
-    char *data = (char *)r + r->io.data_offset;
-    void *guest_addr, *disk_addr;
-    char cmd;
+static void hdd_mmap_submit(struct hdd *hdd, int queue, struct hdd_req *reqs,
+                            unsigned int n) {
+    (void)queue;
 
-    if (r->io.size != 1) {
-        return -1;
+    for (unsigned int i = 0; i < n; i++) {
+        reqs[i].err = 0;
+        if (reqs[i].cmd == HDD_CMD_READ) {
+            memcpy(reqs[i].buf, hdd->disk_addr + reqs[i].off, reqs[i].len);
+        } else if (reqs[i].cmd == HDD_CMD_WRITE) {
+            memcpy(hdd->disk_addr + reqs[i].off, reqs[i].buf, reqs[i].len);
+            if (reqs[i].fua) {
+                reqs[i].err = hdd_mmap_sync(hdd, reqs[i].off, reqs[i].len);
+            }
+        } else {
+            reqs[i].err = hdd_mmap_sync(hdd, reqs[i].off,
+                                        reqs[i].len ? reqs[i].len : hdd->size);
+        }
     }
+}
+
+const struct hdd_backend hdd_mmap_backend = {
+    .name = "mmap",
+    .submit = hdd_mmap_submit,
+};
+
+// called with the lock held
+static void serial_write(struct serial *s, const char *data, size_t len) {
+    char c;
+
+    if (s->prefix == NULL) {
+        fwrite(data, 1, len, stdout);
+        return;
+    }
+
+    // a line too long for the buffer is split
+    for (size_t i = 0; i < len; i++) {
+        c = data[i];
+        s->line[s->line_len++] = c;
+        if (c == '\n' || s->line_len == sizeof(s->line)) {
+            printf("%s%.*s", s->prefix, (int)s->line_len, s->line);
+            s->line_len = 0;
+        }
+    }
+}
 
-    cmd = *data;
+// prints all the writes to the serial port coalesced by KVM. Must be called
+// before handling any exit to keep the output ordered with the other devices.
+void serial_flush(struct serial *s) {
+    struct kvm_coalesced_mmio *m;
+    char buf[4096];
+    unsigned int first, last, n = 0;
 
-    if (hdd->op.guest_addr_off >= guest_mem_size) {
-        if (hdd->status) {
-            hdd->status->err = EFAULT;
+    if (s->ring == NULL) return;
+
+    pthread_mutex_lock(&s->lock);
+    first = s->ring->first;
+    last = __atomic_load_n(&s->ring->last, __ATOMIC_ACQUIRE);
+    for (; first != last; first = (first + 1) % s->ring_max) {
+        m = &s->ring->coalesced_mmio[first];
+        if (n + m->len > sizeof(buf)) {
+            serial_write(s, buf, n);
+            n = 0;
         }
+        memcpy(buf + n, m->data, m->len);
+        n += m->len;
+    }
+    __atomic_store_n(&s->ring->first, first, __ATOMIC_RELEASE);
+    serial_write(s, buf, n);
+    pthread_mutex_unlock(&s->lock);
+}
+
+static void serial_flush_timer(void *opaque) {
+    serial_flush(opaque);
+    fflush(stdout);
+}
+
+static int register_coalesced(int vm_fd, __u64 addr, __u32 size, __u32 pio) {
+    struct kvm_coalesced_mmio_zone zone = {
+        .addr = addr,
+        .size = size,
+        .pio = pio,
+    };
+
+    return ioctl(vm_fd, KVM_REGISTER_COALESCED_MMIO, &zone);
+}
+
+// writes to the serial port do not exit: KVM queues them in a ring, shared by
+// all the vCPUs and mapped after the kvm_run structure of each one
+int serial_setup(struct serial *s, int vm_fd, struct kvm_run *r,
+                 struct event_loop *loop, const char *prefix) {
+    long page_size = sysconf(_SC_PAGESIZE);
+    int res, offset;
+
+    s->ring = NULL;
+    s->prefix = prefix;
+    s->line_len = 0;
+    pthread_mutex_init(&s->lock, NULL);
+
+    offset = ioctl(vm_fd, KVM_CHECK_EXTENSION, KVM_CAP_COALESCED_MMIO);
+    if (offset <= 0) {
+        printf("\t- Coalesced MMIO not supported\n");
         return 0;
     }
-    guest_addr = guest_mem_addr + hdd->op.guest_addr_off;
 
-    if (cmd != HDD_CMD_SETUP && hdd->op.sector >= hdd->size / HDD_SECTOR_SIZE) {
-        if (hdd->status) {
-            hdd->status->err = EINVAL;
+    // the guest may use either port or memory-mapped I/O
+    res = register_coalesced(vm_fd, MMIO_ADDR + SERIAL_PORT * 8, 8, 0);
+    if (res < 0) {
+        perror("ioctl(KVM_REGISTER_COALESCED_MMIO)");
+        return -1;
+    }
+    if (ioctl(vm_fd, KVM_CHECK_EXTENSION, KVM_CAP_COALESCED_PIO) > 0) {
+        res = register_coalesced(vm_fd, SERIAL_PORT, 1, 1);
+        if (res < 0) {
+            perror("ioctl(KVM_REGISTER_COALESCED_MMIO)");
+            return -1;
         }
+    }
+
+    s->ring = (void *)r + offset * page_size;
+    s->ring_max = (page_size - sizeof(struct kvm_coalesced_mmio_ring)) /
+                  sizeof(struct kvm_coalesced_mmio);
+
+    s->flush.handler = serial_flush_timer;
+    s->flush.opaque = s;
+    return event_add_timer(loop, &s->flush, SERIAL_FLUSH_INTERVAL_NS);
+}
+
+static int handle_serial(void *opaque, int vcpu, unsigned int reg,
+                         const void *data, unsigned int size,
+                         unsigned int count) {
+    struct serial *s = opaque;
+
+    (void)vcpu;
+    (void)reg;
+
+    // string I/O (rep outsb) carries a whole buffer in a single exit
+    pthread_mutex_lock(&s->lock);
+    serial_write(s, data, (size_t)size * count);
+    pthread_mutex_unlock(&s->lock);
+
+    return 0;
+}
+
+int serial_register(struct serial *s, struct bus *bus) {
+    s->dev.name = "serial";
+    s->dev.opaque = s;
+    s->dev.write = handle_serial;
+    s->dev.read = NULL;
+
+    if (bus_register_pio(bus, &s->dev, SERIAL_PORT, 1) < 0) return -1;
+    return bus_register_mmio(bus, &s->dev, MMIO_ADDR + SERIAL_PORT * 8, 1);
+}
+
+// checks a request from the guest and translates it into a backend request,
+// returns the error code to report to the guest
+static int hdd_range_ok(struct hdd *hdd, sector_t sector, sector_t count) {
+    return count > 0 && count <= hdd->size / HDD_SECTOR_SIZE &&
+           sector <= hdd->size / HDD_SECTOR_SIZE - count;
+}
+
+static int hdd_req_init(struct hdd *hdd, struct hdd_req *req, int cmd,
+                        sector_t sector, sector_t count,
+                        guest_addr_t guest_addr_off, void *guest_mem_addr,
+                        size_t guest_mem_size) {
+    size_t len = (size_t)HDD_SECTOR_SIZE * count;
+    int fua = cmd & HDD_CMD_FUA;
+
+    cmd &= ~HDD_CMD_FUA;
+    if (cmd == HDD_CMD_FLUSH && !fua) {
+        req->cmd = cmd;
+        req->fua = 0;
+        req->buf = NULL;
+        req->off = 0;
+        req->len = 0;
+        req->err = 0;
+        return 0;
+    }
+    // the guest wrote the sectors itself, there is no buffer
+    if (cmd == HDD_CMD_DAX_FLUSH && !fua) {
+        if (!hdd_range_ok(hdd, sector, count)) return EINVAL;
+        req->cmd = HDD_CMD_FLUSH;
+        req->fua = 0;
+        req->buf = NULL;
+        req->off = (size_t)HDD_SECTOR_SIZE * sector;
+        req->len = len;
+        req->err = 0;
         return 0;
     }
-    disk_addr = hdd->disk_addr + (HDD_SECTOR_SIZE * hdd->op.sector);
+
+    if (guest_addr_off >= guest_mem_size ||
+        guest_mem_size - guest_addr_off < len) {
+        return EFAULT;
+    }
+
+    if (!hdd_range_ok(hdd, sector, count)) {
+        return EINVAL;
+    }
+
+    if ((cmd != HDD_CMD_READ && cmd != HDD_CMD_WRITE) ||
+        (fua && cmd != HDD_CMD_WRITE)) {
+        return EINVAL;
+    }
+
+    req->cmd = cmd;
+    req->fua = cmd == HDD_CMD_WRITE && (fua || hdd->writethrough);
+    req->buf = guest_mem_addr + guest_addr_off;
+    req->off = (size_t)HDD_SECTOR_SIZE * sector;
+    req->len = len;
+    req->err = 0;
+    return 0;
+}
+
+static void hdd_account(struct hdd *hdd, struct hdd_req *reqs, unsigned int n) {
+    for (unsigned int i = 0; i < n; i++) {
+        if (reqs[i].err) {
+            __atomic_fetch_add(&hdd->stats.errors, 1, __ATOMIC_RELAXED);
+        } else if (reqs[i].cmd == HDD_CMD_READ) {
+            __atomic_fetch_add(&hdd->stats.reads, 1, __ATOMIC_RELAXED);
+            __atomic_fetch_add(&hdd->stats.bytes_read, reqs[i].len,
+                               __ATOMIC_RELAXED);
+            if (hdd->dirty) {
+                dirty_log_mark(
+                    hdd->dirty,
+                    (char *)reqs[i].buf - (char *)hdd->guest_mem_addr,
+                    reqs[i].len);
+            }
+        } else if (reqs[i].cmd == HDD_CMD_FLUSH) {
+            __atomic_fetch_add(&hdd->stats.flushes, 1, __ATOMIC_RELAXED);
+        } else {
+            __atomic_fetch_add(&hdd->stats.writes, 1, __ATOMIC_RELAXED);
+            __atomic_fetch_add(&hdd->stats.bytes_written, reqs[i].len,
+                               __ATOMIC_RELAXED);
+        }
+    }
+}
+
+static void hdd_trace(struct hdd_queue *q, struct hdd_req *reqs,
+                      unsigned int n, uint64_t time, uint64_t latency) {
+    struct trace_record recs[HDD_RING_SIZE];
+
+    memset(recs, 0, n * sizeof(recs[0]));
+    for (unsigned int i = 0; i < n; i++) {
+        recs[i].time = time - q->hdd->trace->start;
+        recs[i].latency = latency;
+        recs[i].off = reqs[i].off;
+        recs[i].len = reqs[i].len;
+        recs[i].cmd = reqs[i].cmd;
+        recs[i].fua = reqs[i].fua;
+        recs[i].disk = q->hdd->id;
+        recs[i].queue = q->id;
+        recs[i].vm = q->hdd->vm;
+        recs[i].vcpu = q->vcpu;
+        recs[i].err = reqs[i].err;
+    }
+    trace_add(q->hdd->trace, recs, n);
+}
+
+// submits up to HDD_RING_SIZE requests of a queue to the backend as a batch,
+// they all complete (and are traced) together
+static void hdd_submit(struct hdd_queue *q, struct hdd_req *reqs,
+                       unsigned int n) {
+    struct hdd *hdd = q->hdd;
+    uint64_t t = 0;
+
+    if (hdd->trace) t = stats_now();
+    hdd->backend->submit(hdd, q->id, reqs, n);
+    hdd_account(hdd, reqs, n);
+    if (hdd->trace) hdd_trace(q, reqs, n, t, stats_now() - t);
+}
+
+// copies count contiguous sectors between the disk and the guest memory, or
+// flushes the disk. Returns the error code to report to the guest.
+static int hdd_transfer(struct hdd_queue *q, int cmd, sector_t sector,
+                        sector_t count, guest_addr_t guest_addr_off,
+                        void *guest_mem_addr, size_t guest_mem_size) {
+    struct hdd *hdd = q->hdd;
+    struct hdd_req req;
+    int err;
+
+    err = hdd_req_init(hdd, &req, cmd, sector, count, guest_addr_off,
+                       guest_mem_addr, guest_mem_size);
+    if (err) {
+        __atomic_fetch_add(&hdd->stats.errors, 1, __ATOMIC_RELAXED);
+        return err;
+    }
+
+    hdd_submit(q, &req, 1);
+    return req.err;
+}
+
+// consumes all the descriptors posted by the guest since the last kick,
+// submitting them to the backend as a single batch
+static int handle_hdd_ring_kick(struct hdd_queue *q, void *guest_mem_addr,
+                                size_t guest_mem_size) {
+    struct hdd *hdd = q->hdd;
+    struct hdd_ring *ring = q->ring;
+    struct hdd_desc *desc, *descs[HDD_RING_SIZE];
+    struct hdd_req reqs[HDD_RING_SIZE];
+    unsigned int head, tail, n = 0;
+    int err = 0;
+
+    if (ring == NULL) {
+        return EINVAL;
+    }
+
+    // the ring may be consumed by the I/O thread while the guest is running
+    head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    tail = ring->tail;
+    if (head - tail > HDD_RING_SIZE) {
+        return EINVAL;
+    }
+
+    for (; tail != head; tail++) {
+        desc = &ring->desc[tail & (HDD_RING_SIZE - 1)];
+        desc->err = hdd_req_init(hdd, &reqs[n], desc->cmd, desc->sector, 1,
+                                 desc->guest_addr, guest_mem_addr,
+                                 guest_mem_size);
+        if (!desc->err) {
+            descs[n++] = desc;
+        } else {
+            __atomic_fetch_add(&hdd->stats.errors, 1, __ATOMIC_RELAXED);
+        }
+    }
+
+    if (n > 0) {
+        hdd_submit(q, reqs, n);
+        for (unsigned int i = 0; i < n; i++) {
+            descs[i]->err = reqs[i].err;
+        }
+    }
+
+    for (unsigned int i = ring->tail; i != tail; i++) {
+        desc = &ring->desc[i & (HDD_RING_SIZE - 1)];
+        if (desc->err) {
+            err = desc->err;
+            break;
+        }
+    }
+    __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+
+    return err;
+}
+
+// the status of the kicked ring is set, the guest may stop waiting for it
+static void hdd_raise_irq(struct hdd *hdd) {
+    uint64_t one = 1;
+
+    if (hdd->irq_fd < 0) return;
+    if (write(hdd->irq_fd, &one, sizeof(one)) != sizeof(one)) {
+        perror("write(irqfd)");
+    }
+}
+
+static int handle_hdd_cmd_locked(struct hdd_queue *q, char cmd,
+                                 void *guest_mem_addr, size_t guest_mem_size) {
+    struct hdd_op *op = &q->op;
+    void *guest_addr;
 
     switch (cmd) {
         case HDD_CMD_READ:
-            memcpy(guest_addr, disk_addr, HDD_SECTOR_SIZE);
-            hdd->status->err = 0;
-            return 0;
         case HDD_CMD_WRITE:
-            memcpy(disk_addr, guest_addr, HDD_SECTOR_SIZE);
-            hdd->status->err = 0;
+        case HDD_CMD_WRITE | HDD_CMD_FUA:
+        case HDD_CMD_FLUSH:
+        case HDD_CMD_DAX_FLUSH:
+            // the result goes to the status structure, nothing to do without
+            // one (as for the kicks handled by the event loop)
+            if (q->status == NULL) {
+                return 0;
+            }
+            q->status->err =
+                hdd_transfer(q, cmd, op->sector, op->count,
+                             op->guest_addr_off, guest_mem_addr,
+                             guest_mem_size);
+            // the sector count only applies to the next command
+            op->count = 1;
+            return 0;
+        case HDD_CMD_RING_KICK:
+            if (q->status == NULL) {
+                return 0;
+            }
+            q->status->err =
+                handle_hdd_ring_kick(q, guest_mem_addr, guest_mem_size);
+            hdd_raise_irq(q->hdd);
             return 0;
         case HDD_CMD_SETUP:
-            hdd->status = guest_addr;
-            hdd->status->size = hdd->size;
-            hdd->status->err = 0;
+        case HDD_CMD_RING_SETUP:
+            break;
+        default:
+            return -1;
+    }
+
+    if (op->guest_addr_off >= guest_mem_size) {
+        if (q->status) {
+            q->status->err = EFAULT;
+        }
+        return 0;
+    }
+    guest_addr = guest_mem_addr + op->guest_addr_off;
+
+    switch (cmd) {
+        case HDD_CMD_SETUP:
+            q->status = guest_addr;
+            q->status->size = q->hdd->size;
+            q->status->dax_size = q->hdd->dax_size;
+            q->status->err = 0;
+            return 0;
+        case HDD_CMD_RING_SETUP:
+            if (q->status == NULL) {
+                return -1;
+            }
+            if (guest_mem_size - op->guest_addr_off <
+                sizeof(struct hdd_ring)) {
+                q->status->err = EFAULT;
+                return 0;
+            }
+            q->ring = guest_addr;
+            q->ring->tail = q->ring->head;
+            q->status->err = 0;
             return 0;
         default:
             return -1;
     }
 }
 
-static int handle_hdd_set_addr(struct hdd *hdd, struct kvm_run *r) {
-    char *data = (char *)r + r->io.data_offset;
+static int handle_hdd_cmd(struct hdd_queue *q, int vcpu, const void *data,
+                          unsigned int size) {
+    int res;
 
-    if (r->io.size != sizeof(hdd->op.guest_addr_off)) {
+    if (size != 1) {
         return -1;
     }
 
-    hdd->op.guest_addr_off = *(guest_addr_t *)data;
+    pthread_mutex_lock(&q->lock);
+    q->vcpu = vcpu;
+    res = handle_hdd_cmd_locked(q, *(char *)data, q->hdd->guest_mem_addr,
+                                q->hdd->guest_mem_size);
+    pthread_mutex_unlock(&q->lock);
+
+    return res;
+}
+
+static int handle_hdd_set_addr(struct hdd_op *op, const void *data,
+                               unsigned int size) {
+    if (size != sizeof(op->guest_addr_off)) {
+        return -1;
+    }
+
+    op->guest_addr_off = *(guest_addr_t *)data;
     return 0;
 }
 
-static int handle_hdd_set_sector(struct hdd *hdd, struct kvm_run *r) {
-    char *data = (char *)r + r->io.data_offset;
+static int handle_hdd_set_sector(struct hdd_op *op, const void *data,
+                                 unsigned int size) {
+    if (size != sizeof(op->sector)) {
+        return -1;
+    }
+
+    op->sector = *(sector_t *)data;
+    return 0;
+}
 
-    if (r->io.size != sizeof(hdd->op.sector)) {
+static int handle_hdd_set_count(struct hdd_op *op, const void *data,
+                                unsigned int size) {
+    if (size != sizeof(op->count)) {
         return -1;
     }
 
-    hdd->op.sector = *(sector_t *)data;
+    op->count = *(sector_t *)data;
     return 0;
 }
 
-int handle_hdd(struct hdd *hdd, struct kvm_run *r, void *guest_mem_addr,
-               size_t guest_mem_size) {
-    if (r->io.direction != KVM_EXIT_IO_OUT) {
+// the registers of the queues follow each other
+static struct hdd_queue *hdd_reg_queue(struct hdd *hdd, unsigned int reg) {
+    return &hdd->queues[reg / HDD_NR_PORTS];
+}
+
+static int handle_hdd_write(void *opaque, int vcpu, unsigned int reg,
+                            const void *data, unsigned int size,
+                            unsigned int count) {
+    struct hdd_queue *q = hdd_reg_queue(opaque, reg);
+    struct hdd_op *op = &q->op;
+
+    if (count != 1) {
+        return -1;
+    }
+
+    switch (HDD_SECTOR_PORT + reg % HDD_NR_PORTS) {
+        case HDD_CMD_PORT:
+            return handle_hdd_cmd(q, vcpu, data, size);
+        case HDD_DMA_ADDR_PORT:
+            return handle_hdd_set_addr(op, data, size);
+        case HDD_SECTOR_PORT:
+            return handle_hdd_set_sector(op, data, size);
+        case HDD_COUNT_PORT:
+            return handle_hdd_set_count(op, data, size);
+        default:
+            return -1;
+    }
+}
+
+// the registers read back their current value, the command register the
+// error of the last operation
+static int handle_hdd_read(void *opaque, int vcpu, unsigned int reg,
+                           void *data, unsigned int size, unsigned int count) {
+    struct hdd_queue *q = hdd_reg_queue(opaque, reg);
+    struct hdd_op *op = &q->op;
+
+    (void)vcpu;
+
+    if (count != 1) {
         return -1;
     }
 
-    switch (r->io.port) {
+    switch (HDD_SECTOR_PORT + reg % HDD_NR_PORTS) {
         case HDD_CMD_PORT:
-            return handle_hdd_cmd(hdd, r, guest_mem_addr, guest_mem_size);
+            if (size != 1) return -1;
+            *(char *)data = q->status ? q->status->err : 0;
+            return 0;
         case HDD_DMA_ADDR_PORT:
-            return handle_hdd_set_addr(hdd, r);
+            if (size != sizeof(op->guest_addr_off)) return -1;
+            *(guest_addr_t *)data = op->guest_addr_off;
+            return 0;
         case HDD_SECTOR_PORT:
-            return handle_hdd_set_sector(hdd, r);
+            if (size != sizeof(op->sector)) return -1;
+            *(sector_t *)data = op->sector;
+            return 0;
+        case HDD_COUNT_PORT:
+            if (size != sizeof(op->count)) return -1;
+            *(sector_t *)data = op->count;
+            return 0;
         default:
             return -1;
     }
 }
+
+void hdd_init(struct hdd *hdd, int id) {
+    hdd->id = id;
+    hdd->irq_fd = -1;
+    for (int i = 0; i < HDD_MAX_QUEUES; i++) {
+        hdd->queues[i].hdd = hdd;
+        hdd->queues[i].id = i;
+        hdd->queues[i].op.count = 1;
+        pthread_mutex_init(&hdd->queues[i].lock, NULL);
+    }
+}
+
+void hdd_reset(struct hdd *hdd) {
+    struct hdd_queue *q;
+
+    for (int i = 0; i < HDD_MAX_QUEUES; i++) {
+        q = &hdd->queues[i];
+        pthread_mutex_lock(&q->lock);
+        memset(&q->op, 0, sizeof(q->op));
+        q->op.count = 1;
+        q->status = NULL;
+        q->ring = NULL;
+        pthread_mutex_unlock(&q->lock);
+    }
+}
+
+int hdd_register(struct hdd *hdd, struct bus *bus) {
+    unsigned int port = HDD_PORT(hdd->id, 0);
+
+    hdd->dev.name = "hdd";
+    hdd->dev.opaque = hdd;
+    hdd->dev.write = handle_hdd_write;
+    hdd->dev.read = handle_hdd_read;
+
+    if (bus_register_pio(bus, &hdd->dev, port,
+                         HDD_NR_PORTS * HDD_MAX_QUEUES) < 0) {
+        return -1;
+    }
+    return bus_register_mmio(bus, &hdd->dev, MMIO_ADDR + port * 8,
+                             HDD_NR_PORTS * HDD_MAX_QUEUES);
+}
+
+static unsigned long long hdd_guest_off(struct hdd *hdd, void *p) {
+    return p ? (unsigned long long)((char *)p - (char *)hdd->guest_mem_addr)
+             : HDD_STATE_NONE;
+}
+
+void hdd_save_state(struct hdd *hdd, struct hdd_state *st) {
+    struct hdd_queue *q;
+
+    for (int i = 0; i < HDD_MAX_QUEUES; i++) {
+        q = &hdd->queues[i];
+        pthread_mutex_lock(&q->lock);
+        st->queues[i].op = q->op;
+        st->queues[i].status_off = hdd_guest_off(hdd, q->status);
+        st->queues[i].ring_off = hdd_guest_off(hdd, q->ring);
+        pthread_mutex_unlock(&q->lock);
+    }
+}
+
+int hdd_load_state(struct hdd *hdd, const struct hdd_state *st) {
+    const struct hdd_queue_state *qs;
+    struct hdd_queue *q;
+
+    for (int i = 0; i < HDD_MAX_QUEUES; i++) {
+        qs = &st->queues[i];
+        if ((qs->status_off != HDD_STATE_NONE &&
+             qs->status_off + sizeof(struct hdd_status) >
+                 hdd->guest_mem_size) ||
+            (qs->ring_off != HDD_STATE_NONE &&
+             qs->ring_off + sizeof(struct hdd_ring) > hdd->guest_mem_size)) {
+            fprintf(stderr, "hdd: bad saved state\n");
+            return -1;
+        }
+    }
+
+    for (int i = 0; i < HDD_MAX_QUEUES; i++) {
+        qs = &st->queues[i];
+        q = &hdd->queues[i];
+        pthread_mutex_lock(&q->lock);
+        q->op = qs->op;
+        q->status = NULL;
+        q->ring = NULL;
+        if (qs->status_off != HDD_STATE_NONE) {
+            q->status = (void *)((char *)hdd->guest_mem_addr + qs->status_off);
+            // the disk may not be the one of the snapshot
+            q->status->size = hdd->size;
+        }
+        if (qs->ring_off != HDD_STATE_NONE) {
+            q->ring = (void *)((char *)hdd->guest_mem_addr + qs->ring_off);
+        }
+        pthread_mutex_unlock(&q->lock);
+    }
+
+    return 0;
+}
+
+static void hdd_kick_event(void *opaque) {
+    struct hdd_queue *q = opaque;
+
+    pthread_mutex_lock(&q->lock);
+    q->vcpu = -1;
+    if (q->status) {
+        q->status->err = handle_hdd_ring_kick(q, q->hdd->guest_mem_addr,
+                                              q->hdd->guest_mem_size);
+        hdd_raise_irq(q->hdd);
+    }
+    pthread_mutex_unlock(&q->lock);
+}
+
+static int register_ioeventfd(int vm_fd, int fd, __u64 addr, __u32 flags) {
+    struct kvm_ioeventfd ioeventfd = {
+        .datamatch = HDD_CMD_RING_KICK,
+        .addr = addr,
+        .len = 1,
+        .fd = fd,
+        .flags = KVM_IOEVENTFD_FLAG_DATAMATCH | flags,
+    };
+
+    return ioctl(vm_fd, KVM_IOEVENTFD, &ioeventfd);
+}
+
+// ring kicks are handled by KVM through an ioeventfd and processed by the event
+// loop, so that the vCPU never exits for them
+static int hdd_queue_async_start(struct hdd_queue *q, int vm_fd,
+                                 struct event_loop *loop) {
+    unsigned int port = HDD_PORT(q->hdd->id, q->id) + HDD_CMD_PORT -
+                        HDD_SECTOR_PORT;
+    int res;
+
+    q->kick.fd = eventfd(0, EFD_CLOEXEC);
+    if (q->kick.fd < 0) {
+        perror("eventfd");
+
+        return -1;
+    }
+
+    // the guest may use either port or memory-mapped I/O
+    res = register_ioeventfd(vm_fd, q->kick.fd, port,
+                             KVM_IOEVENTFD_FLAG_PIO);
+    if (res < 0) {
+        perror("ioctl(KVM_IOEVENTFD)");
+
+        return -2;
+    }
+    res = register_ioeventfd(vm_fd, q->kick.fd, MMIO_ADDR + port * 8, 0);
+    if (res < 0) {
+        perror("ioctl(KVM_IOEVENTFD)");
+
+        return -2;
+    }
+
+    q->kick.handler = hdd_kick_event;
+    q->kick.opaque = q;
+    if (event_add(loop, &q->kick) < 0) {
+        return -3;
+    }
+
+    return 0;
+}
+
+int hdd_async_start(struct hdd *hdd, int vm_fd, struct event_loop *loop) {
+    int res;
+
+    for (int i = 0; i < HDD_MAX_QUEUES; i++) {
+        res = hdd_queue_async_start(&hdd->queues[i], vm_fd, loop);
+        if (res < 0) return res;
+    }
+
+    return 0;
+}
+
+int hdd_irq_setup(struct hdd *hdd, int vm_fd) {
+    struct kvm_irqfd irqfd = {
+        .gsi = HDD_IRQ(hdd->id),
+    };
+
+    hdd->irq_fd = eventfd(0, EFD_CLOEXEC);
+    if (hdd->irq_fd < 0) {
+        perror("eventfd");
+
+        return -1;
+    }
+
+    irqfd.fd = hdd->irq_fd;
+    if (ioctl(vm_fd, KVM_IRQFD, &irqfd) < 0) {
+        perror("ioctl(KVM_IRQFD)");
+
+        return -2;
+    }
+
+    return 0;
+}
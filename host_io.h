@@ -1,21 +1,138 @@
 #include <linux/kvm.h>
+#include <pthread.h>
 #include <stdlib.h>
 
+#include "bus.h"
+#include "dirty.h"
 #include "io.h"
+#include "stats.h"
 
-extern int handle_serial(struct kvm_run *r);
+#define SERIAL_LINE_MAX 256
+
+struct serial {
+    // writes coalesced by KVM, NULL if not supported
+    struct kvm_coalesced_mmio_ring *ring;
+    unsigned int ring_max;
+    pthread_mutex_t lock;
+    struct event flush;
+    // with a prefix the output is printed a line at a time, each line starting
+    // with it, so that the output of many VMs does not mix
+    const char *prefix;
+    char line[SERIAL_LINE_MAX];
+    unsigned int line_len;
+    struct bus_device dev;
+};
+
+// prefix may be NULL. The writes coalesced by KVM are printed from the loop.
+extern int serial_setup(struct serial *s, int vm_fd, struct kvm_run *r,
+                        struct event_loop *loop, const char *prefix);
+extern void serial_flush(struct serial *s);
+extern int serial_register(struct serial *s, struct bus *bus);
 
 #define sector_t unsigned int
 #define guest_addr_t unsigned int
+
+// a request to a disk backend, already checked against the disk and the guest
+// memory bounds. A flush has no buffer and covers [off, off + len), or the
+// whole disk if len is 0 (the backends may always flush the whole disk).
+struct hdd_req {
+    int cmd;  // HDD_CMD_READ, HDD_CMD_WRITE or HDD_CMD_FLUSH
+    int fua;  // the write must be durable before completing
+    void *buf;
+    size_t off;
+    size_t len;
+    int err;  // error code to report to the guest
+};
+
+struct hdd;
+struct trace;
+struct hdd_backend {
+    const char *name;
+    // performs the n requests of a queue, setting the err field of each one.
+    // The queues of a disk may submit concurrently.
+    void (*submit)(struct hdd *hdd, int queue, struct hdd_req *reqs,
+                   unsigned int n);
+};
+
+// copies from and to the disk image mapped at disk_addr
+extern const struct hdd_backend hdd_mmap_backend;
+
+#define MAX_VCPUS 8
+
+// registers used to build a single command
+struct hdd_op {
+    guest_addr_t guest_addr_off;
+    sector_t sector;
+    sector_t count;
+};
+
+// each queue has its own registers, status and ring, so that the guest can
+// issue commands on different queues without any locking
+struct hdd_queue {
+    struct hdd *hdd;
+    int id;
+    struct hdd_op op;
+    struct hdd_status *status;
+    struct hdd_ring *ring;
+    // serializes the vCPUs and the event loop using the queue
+    pthread_mutex_t lock;
+    struct event kick;  // ring kicks, with --async-hdd
+    int vcpu;  // that issued the current command, -1 for the event loop
+};
+
 struct hdd {
+    int id;  // the registers are at HDD_PORT(id, queue)
+    const struct hdd_backend *backend;
+    void *backend_data;
     void *disk_addr;
     size_t size;
-    struct {
-        guest_addr_t guest_addr_off;
-        sector_t sector;
-    } op;
-    struct hdd_status *status;
+    // every write is durable before completing, as if the guest set FUA
+    int writethrough;
+    // DMA can only reach this part of the guest memory
+    void *guest_mem_addr;
+    size_t guest_mem_size;
+    struct hdd_queue queues[HDD_MAX_QUEUES];
+    struct hdd_stats stats;
+    struct dirty_log *dirty;  // guest memory written by DMA, NULL if not logged
+    int irq_fd;  // irqfd of the HDD_IRQ pin, -1 if there is no interrupt
+    size_t dax_size;  // mapped at HDD_DAX_ADDR(id) in the guest, 0 if not
+    struct trace *trace;  // records the requests, NULL if not traced
+    int vm;  // id of the VM in the trace
+    struct bus_device dev;
 };
 
-extern int handle_hdd(struct hdd *hdd, struct kvm_run *r, void *guest_mem_addr,
-                      size_t guest_mem_size);
+extern void hdd_init(struct hdd *hdd, int id);
+// forgets the status structures and rings set up by the guest, as at boot
+extern void hdd_reset(struct hdd *hdd);
+extern int hdd_register(struct hdd *hdd, struct bus *bus);
+// ring kicks go through ioeventfds, processed by the event loop
+extern int hdd_async_start(struct hdd *hdd, int vm_fd,
+                           struct event_loop *loop);
+// every ring kick raises HDD_IRQ(id) when completed, both from the vCPU and
+// from the event loop. The other commands complete before the guest resumes.
+extern int hdd_irq_setup(struct hdd *hdd, int vm_fd);
+
+// device state saved in snapshots, pointers into guest memory are offsets
+#define HDD_STATE_NONE (~0ull)
+struct hdd_queue_state {
+    struct hdd_op op;
+    unsigned long long status_off;
+    unsigned long long ring_off;
+};
+
+struct hdd_state {
+    struct hdd_queue_state queues[HDD_MAX_QUEUES];
+};
+
+extern void hdd_save_state(struct hdd *hdd, struct hdd_state *st);
+extern int hdd_load_state(struct hdd *hdd, const struct hdd_state *st);
+
+// io_uring backend with a ring for each queue, guest memory is registered to
+// avoid mapping it on every request (the buffers outside of it use plain
+// reads and writes). O_DIRECT is used if direct is set.
+extern int hdd_uring_setup(struct hdd *hdd, const char *fname, int direct,
+                           void *guest_mem_addr, size_t guest_mem_size);
+// the disk is a copy-on-write overlay on top of a read-only backing file, the
+// overlay is created (in constant time) if it does not exist
+extern int hdd_cow_setup(struct hdd *hdd, const char *fname,
+                         const char *backing_fname);
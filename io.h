@@ -1,21 +1,83 @@
-#define MMIO_ADDR 0x200000
+// 2 MB window in the hole below 4 GB, guest RAM is above and below it
+#define MMIO_ADDR 0xc0000000
+// RAM that does not fit below the MMIO window starts at 4 GB
+#define HIGH_MEM_ADDR 0x100000000ul
 
 #define SERIAL_PORT 0x10
 
-#define HDD_SECTOR_PORT 0x20
-#define HDD_DMA_ADDR_PORT 0x21
-#define HDD_CMD_PORT 0x22
+// the PIC of the in-kernel irqchip owns ports 0x20, 0x21, 0xa0 and 0xa1
+#define HDD_SECTOR_PORT 0x50
+#define HDD_DMA_ADDR_PORT 0x51
+#define HDD_CMD_PORT 0x52
+#define HDD_COUNT_PORT 0x53
+#define HDD_NR_PORTS 4
+
+// every queue of every disk has its own copy of the registers above (which are
+// the ones of disk 0, queue 0), starting at HDD_PORT(disk, queue)
+#define HDD_MAX_DISKS 4
+#define HDD_MAX_QUEUES 4
+#define HDD_PORT(disk, queue) \
+    (HDD_SECTOR_PORT + (disk) * 0x100 + (queue) * HDD_NR_PORTS)
+
+// writing saves a snapshot of the VM (if enabled), reading returns 1 when the
+// VM was restored from a snapshot
+#define SNAPSHOT_PORT 0x30
+
+// the guest writes its exit code when it is done, HLT only waits for the next
+// interrupt
+#define EXIT_PORT 0x31
+
+// interrupt controllers of the in-kernel irqchip. Each disk raises its IOAPIC
+// pin when it completes a ring kick (pins below 16 are shared with the PIC).
+#define IOAPIC_ADDR 0xfec00000
+#define LAPIC_ADDR 0xfee00000
+#define HDD_IRQ(disk) (16 + (disk))
 
 #define HDD_SECTOR_SIZE 512
 
+// with --dax the start of each disk image is also mapped in the guest memory,
+// above the RAM, up to HDD_DAX_WINDOW_SIZE bytes. The windows end at 64 GB,
+// the physical address width of the vCPUs (KVM assumes 36 bits without CPUID).
+#define HDD_DAX_ADDR(disk) (0xf00000000ul + (disk) * HDD_DAX_WINDOW_SIZE)
+#define HDD_DAX_WINDOW_SIZE (1ul << 30)
+
 #define HDD_CMD_READ 0
 #define HDD_CMD_WRITE 1
 #define HDD_CMD_SETUP 2
+#define HDD_CMD_RING_SETUP 3
+#define HDD_CMD_RING_KICK 4
+// makes all the completed writes durable
+#define HDD_CMD_FLUSH 5
+// makes the sectors [sector, sector + count) durable, for the writes done
+// through the DAX window
+#define HDD_CMD_DAX_FLUSH 6
+// flag of HDD_CMD_WRITE: the data is durable when the command completes
+#define HDD_CMD_FUA 0x40
 
 #define EINVAL 22
 #define EFAULT 14
+#define EAGAIN 11
+#define EIO 5
 
 struct hdd_status {
     unsigned long long size;
     int err;
+    unsigned long long dax_size;  // size of the DAX window, 0 without --dax
+};
+
+// number of descriptors in the request ring (must be a power of 2)
+#define HDD_RING_SIZE 64
+
+struct hdd_desc {
+    unsigned int sector;
+    unsigned int guest_addr;
+    int cmd;
+    int err;  // set by the host when the descriptor is consumed
+};
+
+// head is only written by the guest, tail only by the host
+struct hdd_ring {
+    unsigned int head;
+    unsigned int tail;
+    struct hdd_desc desc[HDD_RING_SIZE];
 };
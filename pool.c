@@ -0,0 +1,83 @@
+#include "pool.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static void *pool_reset_thread(void *arg) {
+    struct pool *p = arg;
+    void *item;
+    int res;
+
+    pthread_mutex_lock(&p->lock);
+    for (;;) {
+        while (p->nr_used == 0) {
+            pthread_cond_wait(&p->cond, &p->lock);
+        }
+        item = p->used[--p->nr_used];
+        pthread_mutex_unlock(&p->lock);
+
+        res = p->reset(item);
+
+        pthread_mutex_lock(&p->lock);
+        // an item that cannot be reset is dropped, the pool shrinks
+        if (res < 0) {
+            fprintf(stderr, "pool: reset failed, dropping the item\n");
+        } else {
+            p->ready[p->nr_ready++] = item;
+        }
+        p->pending--;
+        pthread_cond_broadcast(&p->cond);
+    }
+
+    return NULL;
+}
+
+int pool_init(struct pool *p, void **items, int n, int (*reset)(void *item)) {
+    int res;
+
+    p->ready = calloc(n, sizeof(void *));
+    p->used = calloc(n, sizeof(void *));
+    if (p->ready == NULL || p->used == NULL) {
+        perror("malloc(pool)");
+        return -1;
+    }
+    memcpy(p->ready, items, n * sizeof(void *));
+    p->nr_ready = n;
+    p->nr_used = 0;
+    p->pending = 0;
+    p->reset = reset;
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->cond, NULL);
+
+    res = pthread_create(&p->reset_thread, NULL, pool_reset_thread, p);
+    if (res != 0) {
+        fprintf(stderr, "pthread_create: %s\n", strerror(res));
+        return -1;
+    }
+
+    return 0;
+}
+
+void *pool_get(struct pool *p) {
+    void *item = NULL;
+
+    pthread_mutex_lock(&p->lock);
+    while (p->nr_ready == 0 && p->pending > 0) {
+        pthread_cond_wait(&p->cond, &p->lock);
+    }
+    if (p->nr_ready > 0) {
+        item = p->ready[--p->nr_ready];
+    }
+    pthread_mutex_unlock(&p->lock);
+
+    return item;
+}
+
+void pool_put(struct pool *p, void *item) {
+    pthread_mutex_lock(&p->lock);
+    p->used[p->nr_used++] = item;
+    p->pending++;
+    pthread_cond_broadcast(&p->cond);
+    pthread_mutex_unlock(&p->lock);
+}
@@ -0,0 +1,22 @@
+#include <pthread.h>
+
+// items (VMs) created in advance: pool_get hands out one that is ready, and
+// pool_put gives it back to be reset by a background thread, so that it is
+// ready again without delaying the next pool_get
+struct pool {
+    void **ready;
+    int nr_ready;
+    void **used;  // given back, waiting to be reset
+    int nr_used;
+    int pending;  // given back and not ready yet
+    int (*reset)(void *item);
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t reset_thread;
+};
+
+extern int pool_init(struct pool *p, void **items, int n,
+                     int (*reset)(void *item));
+// waits for an item to be ready, NULL if none is ready or being reset
+extern void *pool_get(struct pool *p);
+extern void pool_put(struct pool *p, void *item);
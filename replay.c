@@ -0,0 +1,429 @@
+// replays a disk trace recorded by test --trace against any disk backend,
+// without any guest, and reports the throughput and the latency percentiles
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "host_io.h"
+#include "trace.h"
+
+// the requests of each queue of each disk of each VM are replayed in order by
+// their own thread, the queues run in parallel as in the VMs
+struct replay_queue {
+    struct hdd *hdd;
+    int id;
+    struct trace_record *recs;
+    unsigned long n;
+    char *buf;
+    uint64_t *latencies;  // of each request, as replayed
+    pthread_t thread;
+};
+
+struct replay_options {
+    const char *trace_fname;
+    const char *hdd_fnames[HDD_MAX_DISKS];
+    int nr_disks;
+    int uring;
+    int direct;
+    const char *cow_fname;
+    int max_speed;
+};
+
+static uint64_t replay_start;
+static int replay_max_speed;
+
+// the requests are reported by kind: read, write and flush
+#define NR_KINDS 3
+static const char *kind_names[NR_KINDS] = {"read", "write", "flush"};
+
+static int cmd_kind(int cmd) {
+    switch (cmd) {
+        case HDD_CMD_READ:
+            return 0;
+        case HDD_CMD_WRITE:
+            return 1;
+        case HDD_CMD_FLUSH:
+            return 2;
+        default:
+            return -1;
+    }
+}
+
+// the requests of a batch (a ring kick) were traced together with the same
+// time, and are submitted together again
+static unsigned int batch_size(struct replay_queue *rq, unsigned long i) {
+    unsigned int n = 1;
+
+    while (i + n < rq->n && n < HDD_RING_SIZE &&
+           rq->recs[i + n].time == rq->recs[i].time) {
+        n++;
+    }
+    return n;
+}
+
+static void *replay_thread(void *arg) {
+    struct replay_queue *rq = arg;
+    struct trace_record *rec;
+    struct hdd_req reqs[HDD_RING_SIZE];
+    struct timespec ts;
+    uint64_t t, due;
+    unsigned int n;
+
+    for (unsigned long i = 0; i < rq->n; i += n) {
+        n = batch_size(rq, i);
+        // at the recorded speed, no batch is submitted before its time
+        if (!replay_max_speed) {
+            due = replay_start + rq->recs[i].time;
+            ts.tv_sec = due / 1000000000ull;
+            ts.tv_nsec = due % 1000000000ull;
+            while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts,
+                                   NULL) == EINTR);
+        }
+
+        // each request of the batch has its own sector of the buffer
+        for (unsigned int j = 0; j < n; j++) {
+            rec = &rq->recs[i + j];
+            reqs[j].cmd = rec->cmd;
+            reqs[j].fua = rec->fua;
+            reqs[j].buf = rec->cmd == HDD_CMD_FLUSH
+                              ? NULL
+                              : rq->buf + j * HDD_SECTOR_SIZE;
+            reqs[j].off = rec->off;
+            reqs[j].len = rec->len;
+            reqs[j].err = 0;
+        }
+        t = stats_now();
+        rq->hdd->backend->submit(rq->hdd, rq->id, reqs, n);
+        t = stats_now() - t;
+
+        for (unsigned int j = 0; j < n; j++) {
+            rec = &rq->recs[i + j];
+            rq->latencies[i + j] = t;
+            if (reqs[j].err) {
+                fprintf(stderr, "%s at %lu (%u bytes): error %d\n",
+                        kind_names[cmd_kind(rec->cmd)],
+                        (unsigned long)rec->off, rec->len, reqs[j].err);
+            }
+        }
+    }
+
+    return NULL;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+// prints the throughput and the latency percentiles of n requests, sorting
+// their latencies
+static void print_latencies(const char *name, uint64_t *lat, unsigned long n,
+                            uint64_t bytes, uint64_t elapsed) {
+    static const double pct[] = {50, 90, 99, 99.9};
+
+    if (n == 0) return;
+    qsort(lat, n, sizeof(*lat), cmp_u64);
+    printf("%-6s %8lu ops %10.1f ops/s %9.1f MB/s  latency us:", name, n,
+           n * 1e9 / elapsed, bytes * 1e3 / elapsed);
+    for (unsigned int i = 0; i < sizeof(pct) / sizeof(pct[0]); i++) {
+        printf(" p%g %.1f", pct[i],
+               lat[(unsigned long)(n * pct[i] / 100)] / 1e3);
+    }
+    printf(" max %.1f\n", lat[n - 1] / 1e3);
+}
+
+static void report(struct replay_queue *queues, int nr_queues,
+                   unsigned long total, uint64_t elapsed) {
+    uint64_t *lat[NR_KINDS], bytes[NR_KINDS] = {0};
+    unsigned long n[NR_KINDS] = {0}, j = 0;
+    uint64_t *all;
+    int k;
+
+    all = malloc(total * sizeof(*all));
+    for (k = 0; k < NR_KINDS; k++) {
+        lat[k] = malloc(total * sizeof(*lat[k]));
+        if (lat[k] == NULL) break;
+    }
+    if (all == NULL || k < NR_KINDS) {
+        perror("malloc(latencies)");
+        return;
+    }
+
+    for (int q = 0; q < nr_queues; q++) {
+        for (unsigned long i = 0; i < queues[q].n; i++) {
+            k = cmd_kind(queues[q].recs[i].cmd);
+            all[j++] = queues[q].latencies[i];
+            lat[k][n[k]++] = queues[q].latencies[i];
+            bytes[k] += queues[q].recs[i].len;
+        }
+    }
+
+    printf("Replayed %lu requests in %.3f s\n", total, elapsed / 1e9);
+    for (k = 0; k < NR_KINDS; k++) {
+        print_latencies(kind_names[k], lat[k], n[k], bytes[k], elapsed);
+    }
+    print_latencies("all", all, total, bytes[0] + bytes[1], elapsed);
+}
+
+// each VM has its own instance of the disk, and its own overlays named as by
+// test --vms: FILE, FILE.1... for the first VM, FILE.vm1, FILE.vm1.1...
+static int open_disk(struct hdd *hdd, int vm, int id,
+                     struct replay_options *opts, void *buf, size_t buf_size) {
+    char cow_fname[PATH_MAX];
+    struct stat st;
+    int fd, res;
+
+    hdd_init(hdd, id);
+    if (opts->cow_fname) {
+        res = snprintf(cow_fname, sizeof(cow_fname), "%s", opts->cow_fname);
+        if (vm > 0) {
+            res += snprintf(cow_fname + res, sizeof(cow_fname) - res, ".vm%d",
+                            vm);
+        }
+        if (id > 0) {
+            snprintf(cow_fname + res, sizeof(cow_fname) - res, ".%d", id);
+        }
+        return hdd_cow_setup(hdd, cow_fname, opts->hdd_fnames[id]);
+    }
+    if (opts->uring) {
+        return hdd_uring_setup(hdd, opts->hdd_fnames[id], opts->direct, buf,
+                               buf_size);
+    }
+
+    fd = open(opts->hdd_fnames[id], O_RDWR | O_CLOEXEC);
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        perror("Cannot open disk");
+        return -1;
+    }
+    hdd->size = st.st_size;
+    hdd->disk_addr = mmap(NULL, hdd->size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                          fd, 0);
+    if (hdd->disk_addr == MAP_FAILED) {
+        perror("mmap(disk)");
+        return -1;
+    }
+    close(fd);
+    hdd->backend = &hdd_mmap_backend;
+
+    return 0;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s [options] TRACE DISK...\n"
+            "  -b, --hdd-backend=NAME    disk backend: mmap (default) or "
+            "uring\n"
+            "  -d, --hdd-direct          open the disks with O_DIRECT (uring "
+            "only)\n"
+            "  -c, --cow=FILE            write to copy-on-write overlays of "
+            "the disks\n"
+            "  -m, --max-speed           submit every batch as soon as the "
+            "previous one\n"
+            "                            of its queue completes, instead of "
+            "at its time\n"
+            "  -h, --help                show this message\n"
+            "The disks replace those of the traced VMs, in the same order; "
+            "each VM has\n"
+            "its own instance of them.\n",
+            prog);
+}
+
+static int parse_args(int argc, char *argv[], struct replay_options *opts) {
+    static const struct option long_opts[] = {
+        {"hdd-backend", required_argument, NULL, 'b'},
+        {"hdd-direct", no_argument, NULL, 'd'},
+        {"cow", required_argument, NULL, 'c'},
+        {"max-speed", no_argument, NULL, 'm'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0},
+    };
+    int c;
+
+    memset(opts, 0, sizeof(*opts));
+    while ((c = getopt_long(argc, argv, "b:dc:mh", long_opts, NULL)) != -1) {
+        switch (c) {
+            case 'b':
+                if (strcmp(optarg, "uring") == 0) {
+                    opts->uring = 1;
+                } else if (strcmp(optarg, "mmap") != 0) {
+                    usage(argv[0]);
+                    return -1;
+                }
+                break;
+            case 'd':
+                opts->direct = 1;
+                break;
+            case 'c':
+                opts->cow_fname = optarg;
+                break;
+            case 'm':
+                opts->max_speed = 1;
+                break;
+            default:
+                usage(argv[0]);
+                return -1;
+        }
+    }
+
+    if (argc - optind < 2 || argc - optind - 1 > HDD_MAX_DISKS) {
+        usage(argv[0]);
+        return -1;
+    }
+    opts->trace_fname = argv[optind++];
+    while (optind < argc) {
+        opts->hdd_fnames[opts->nr_disks++] = argv[optind++];
+    }
+
+    return 0;
+}
+
+// index of the queue of a disk of a VM
+#define QUEUE_INDEX(vm, disk, queue) \
+    (((vm) * HDD_MAX_DISKS + (disk)) * HDD_MAX_QUEUES + (queue))
+
+int main(int argc, char *argv[]) {
+    struct replay_options opts;
+    struct replay_queue *queues = NULL, *qs;
+    struct hdd *hdds;
+    struct trace_record rec, *r;
+    struct replay_queue *rq;
+    unsigned long total = 0, skipped = 0;
+    size_t max_len = HDD_SECTOR_SIZE, buf_len;
+    int nr_vms = 0, nr_queues = 0;
+    char *bufs;
+    FILE *f;
+    uint64_t elapsed;
+    int res;
+
+    if (parse_args(argc, argv, &opts) < 0) {
+        return -1;
+    }
+
+    // the requests are split by queue, the largest one sizes the buffers
+    f = trace_read_open(opts.trace_fname);
+    if (f == NULL) {
+        return -1;
+    }
+    while (fread(&rec, sizeof(rec), 1, f) == 1) {
+        if (rec.disk >= opts.nr_disks || rec.queue >= HDD_MAX_QUEUES ||
+            cmd_kind(rec.cmd) < 0) {
+            skipped++;
+            continue;
+        }
+        if (rec.vm >= nr_vms) {
+            res = QUEUE_INDEX(rec.vm + 1, 0, 0);
+            qs = realloc(queues, res * sizeof(*queues));
+            if (qs == NULL) {
+                perror("realloc(queues)");
+                return -1;
+            }
+            queues = qs;
+            memset(queues + nr_queues, 0,
+                   (res - nr_queues) * sizeof(*queues));
+            nr_vms = rec.vm + 1;
+            nr_queues = res;
+        }
+        rq = &queues[QUEUE_INDEX(rec.vm, rec.disk, rec.queue)];
+        if ((rq->n & (rq->n - 1)) == 0) {
+            r = realloc(rq->recs, (rq->n ? 2 * rq->n : 1) * sizeof(rec));
+            if (r == NULL) {
+                perror("realloc(trace)");
+                return -1;
+            }
+            rq->recs = r;
+        }
+        rq->recs[rq->n++] = rec;
+        if (rec.len > max_len) max_len = rec.len;
+        total++;
+    }
+    fclose(f);
+    printf("%lu requests of %d VMs in %s", total, nr_vms, opts.trace_fname);
+    if (skipped) printf(", skipping %lu on the other disks", skipped);
+    printf("\n");
+    if (total == 0) {
+        return 0;
+    }
+
+    // sector aligned for O_DIRECT, and registered with the io_uring. A batch
+    // only has single sector requests, unless it has a single one.
+    if (max_len < HDD_RING_SIZE * HDD_SECTOR_SIZE) {
+        max_len = HDD_RING_SIZE * HDD_SECTOR_SIZE;
+    }
+    max_len = (max_len + 0xfff) & ~(size_t)0xfff;
+    buf_len = max_len * nr_queues;
+    bufs = mmap(NULL, buf_len, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (bufs == MAP_FAILED) {
+        perror("mmap(buffers)");
+        return -1;
+    }
+    hdds = calloc(nr_vms * opts.nr_disks, sizeof(*hdds));
+    if (hdds == NULL) {
+        perror("malloc(disks)");
+        return -1;
+    }
+    for (int vm = 0; vm < nr_vms; vm++) {
+        for (int i = 0; i < opts.nr_disks; i++) {
+            printf("VM %d disk %d: %s (%s)\n", vm, i, opts.hdd_fnames[i],
+                   opts.cow_fname ? "cow" : opts.uring ? "uring" : "mmap");
+            if (open_disk(&hdds[vm * opts.nr_disks + i], vm, i, &opts, bufs,
+                          buf_len) < 0) {
+                return -1;
+            }
+        }
+    }
+
+    for (int q = 0; q < nr_queues; q++) {
+        rq = &queues[q];
+        if (rq->n == 0) continue;
+        rq->hdd = &hdds[q / HDD_MAX_QUEUES / HDD_MAX_DISKS * opts.nr_disks +
+                        q / HDD_MAX_QUEUES % HDD_MAX_DISKS];
+        rq->id = q % HDD_MAX_QUEUES;
+        rq->buf = bufs + q * max_len;
+        rq->latencies = malloc(rq->n * sizeof(uint64_t));
+        if (rq->latencies == NULL) {
+            perror("malloc(latencies)");
+            return -1;
+        }
+        // the disks may be smaller than the traced ones
+        for (unsigned long i = 0; i < rq->n; i++) {
+            if (rq->recs[i].off + rq->recs[i].len > rq->hdd->size) {
+                fprintf(stderr, "request at %lu beyond the end of disk %d\n",
+                        (unsigned long)rq->recs[i].off, rq->hdd->id);
+                return -1;
+            }
+        }
+    }
+
+    printf("Replaying at %s speed...\n",
+           opts.max_speed ? "maximum" : "recorded");
+    fflush(stdout);
+    replay_max_speed = opts.max_speed;
+    replay_start = stats_now();
+    for (int q = 0; q < nr_queues; q++) {
+        if (queues[q].n == 0) continue;
+        res = pthread_create(&queues[q].thread, NULL, replay_thread,
+                             &queues[q]);
+        if (res != 0) {
+            fprintf(stderr, "pthread_create: %s\n", strerror(res));
+            return -1;
+        }
+    }
+    for (int q = 0; q < nr_queues; q++) {
+        if (queues[q].n) pthread_join(queues[q].thread, NULL);
+    }
+    elapsed = stats_now() - replay_start;
+
+    report(queues, nr_queues, total, elapsed);
+
+    return 0;
+}
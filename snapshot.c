@@ -0,0 +1,471 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "host_io.h"
+#include "snapshot.h"
+
+#define SNAPSHOT_MAGIC "KVMSNP3"
+#define SNAPSHOT_PAGE_SIZE DIRTY_PAGE_SIZE
+// guest memory starts 2 MB aligned in the file
+#define SNAPSHOT_ALIGN 0x200000ul
+#define SNAPSHOT_PARENT_MAX 1024
+
+// file layout: the header, the state of each vCPU, the bitmap of the pages in
+// the file (deltas only), then guest memory at mem_offset. Pages that are not
+// in the file are left as holes: in a full snapshot they are zero, in a delta
+// they are the same as in the parent.
+struct snapshot_header {
+    char magic[8];
+    uint32_t nr_vcpus;
+    uint32_t pad;
+    uint64_t mem_size;
+    uint64_t mem_offset;
+    uint64_t bitmap_offset;  // 0 for a full snapshot
+    char parent[SNAPSHOT_PARENT_MAX];  // snapshot the delta applies to
+    uint32_t nr_disks;
+    uint32_t pad2;
+    struct hdd_state hdd[HDD_MAX_DISKS];
+    // the master and slave PIC, then the IOAPIC
+    struct kvm_irqchip irqchip[3];
+};
+
+struct snapshot_vcpu {
+    struct kvm_regs regs;
+    struct kvm_sregs sregs;
+    struct kvm_fpu fpu;
+    struct kvm_lapic_state lapic;
+    struct kvm_vcpu_events events;  // interrupts being injected
+};
+
+static int handle_snapshot_write(void *opaque, int vcpu, unsigned int reg,
+                                 const void *data, unsigned int size,
+                                 unsigned int count) {
+    struct snapshot_dev *sd = opaque;
+
+    (void)vcpu;
+    (void)reg;
+    (void)data;
+    (void)size;
+    (void)count;
+
+    if (sd->fname) sd->pending = 1;
+    return 0;
+}
+
+static int handle_snapshot_read(void *opaque, int vcpu, unsigned int reg,
+                                void *data, unsigned int size,
+                                unsigned int count) {
+    struct snapshot_dev *sd = opaque;
+
+    (void)vcpu;
+    (void)reg;
+
+    if (count != 1) return -1;
+    memset(data, 0, size);
+    *(char *)data = sd->restored;
+    return 0;
+}
+
+int snapshot_register(struct snapshot_dev *sd, struct bus *bus) {
+    sd->dev.name = "snapshot";
+    sd->dev.opaque = sd;
+    sd->dev.write = handle_snapshot_write;
+    sd->dev.read = handle_snapshot_read;
+
+    if (bus_register_pio(bus, &sd->dev, SNAPSHOT_PORT, 1) < 0) return -1;
+    return bus_register_mmio(bus, &sd->dev, MMIO_ADDR + SNAPSHOT_PORT * 8, 1);
+}
+
+static int page_is_zero(const uint8_t *p) {
+    for (int i = 0; i < SNAPSHOT_PAGE_SIZE; i += sizeof(uint64_t)) {
+        if (*(const uint64_t *)(p + i)) return 0;
+    }
+    return 1;
+}
+
+// pages in the file are the non-zero ones, or the dirty ones for a delta
+static int page_is_saved(const uint8_t *mem, size_t off,
+                         const uint64_t *bitmap) {
+    size_t p = off / SNAPSHOT_PAGE_SIZE;
+
+    if (bitmap) return (bitmap[p / 64] >> (p % 64)) & 1;
+    return !page_is_zero(mem + off);
+}
+
+static int snapshot_write_mem(int fd, const uint8_t *mem, size_t mem_size,
+                              uint64_t mem_offset, const uint64_t *bitmap) {
+    size_t off, len;
+
+    for (off = 0; off < mem_size; off += len) {
+        // write runs of pages at once
+        for (len = 0; off + len < mem_size &&
+                      page_is_saved(mem, off + len, bitmap);
+             len += SNAPSHOT_PAGE_SIZE);
+        if (len == 0) {
+            len = SNAPSHOT_PAGE_SIZE;
+            continue;
+        }
+        if (pwrite(fd, mem + off, len, mem_offset + off) != (ssize_t)len) {
+            perror("pwrite(snapshot memory)");
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static int snapshot_save_vcpu(int fd, int vcpu_fd) {
+    struct snapshot_vcpu v;
+
+    if (ioctl(vcpu_fd, KVM_GET_REGS, &v.regs) < 0) {
+        perror("ioctl(KVM_GET_REGS)");
+        return -1;
+    }
+    if (ioctl(vcpu_fd, KVM_GET_SREGS, &v.sregs) < 0) {
+        perror("ioctl(KVM_GET_SREGS)");
+        return -1;
+    }
+    if (ioctl(vcpu_fd, KVM_GET_FPU, &v.fpu) < 0) {
+        perror("ioctl(KVM_GET_FPU)");
+        return -1;
+    }
+    if (ioctl(vcpu_fd, KVM_GET_LAPIC, &v.lapic) < 0) {
+        perror("ioctl(KVM_GET_LAPIC)");
+        return -1;
+    }
+    if (ioctl(vcpu_fd, KVM_GET_VCPU_EVENTS, &v.events) < 0) {
+        perror("ioctl(KVM_GET_VCPU_EVENTS)");
+        return -1;
+    }
+    if (pwrite(fd, &v, sizeof(v), sizeof(struct snapshot_header)) !=
+        sizeof(v)) {
+        perror("pwrite(snapshot vcpu)");
+        return -1;
+    }
+
+    return 0;
+}
+
+// the disk status and ring are written by the host, which KVM does not log
+static void snapshot_mark_hdd(struct dirty_log *d, struct hdd_state *st) {
+    struct hdd_queue_state *qs;
+
+    for (int i = 0; i < HDD_MAX_QUEUES; i++) {
+        qs = &st->queues[i];
+        if (qs->status_off != HDD_STATE_NONE) {
+            dirty_log_mark(d, qs->status_off, sizeof(struct hdd_status));
+        }
+        if (qs->ring_off != HDD_STATE_NONE) {
+            dirty_log_mark(d, qs->ring_off, sizeof(struct hdd_ring));
+        }
+    }
+}
+
+static int snapshot_write(struct snapshot_dev *sd, const char *fname,
+                          int vcpu_fd, void *mem, size_t mem_size) {
+    struct snapshot_header hdr;
+    uint64_t *bitmap = NULL;
+    size_t bitmap_size;
+    int fd, res = -1;
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, SNAPSHOT_MAGIC, sizeof(hdr.magic));
+    hdr.nr_vcpus = 1;
+    hdr.mem_size = mem_size;
+    hdr.nr_disks = sd->nr_disks;
+    for (int i = 0; i < sd->nr_disks; i++) {
+        hdd_save_state(sd->hdds[i], &hdr.hdd[i]);
+    }
+    for (int i = 0; i < 3; i++) {
+        hdr.irqchip[i].chip_id = i;
+        if (ioctl(sd->vm_fd, KVM_GET_IRQCHIP, &hdr.irqchip[i]) < 0) {
+            perror("ioctl(KVM_GET_IRQCHIP)");
+            return -1;
+        }
+    }
+
+    bitmap_size = (mem_size / SNAPSHOT_PAGE_SIZE + 63) / 64 * sizeof(uint64_t);
+    if (sd->parent) {
+        bitmap = malloc(bitmap_size);
+        if (bitmap == NULL) {
+            perror("malloc(snapshot bitmap)");
+            return -1;
+        }
+        for (int i = 0; i < sd->nr_disks; i++) {
+            snapshot_mark_hdd(sd->dirty, &hdr.hdd[i]);
+        }
+        if (dirty_log_take(sd->dirty, bitmap) < 0) {
+            goto out;
+        }
+        strcpy(hdr.parent, sd->parent);
+        hdr.bitmap_offset = sizeof(hdr) + sizeof(struct snapshot_vcpu);
+        hdr.mem_offset = hdr.bitmap_offset + bitmap_size;
+    } else {
+        // start logging from the full snapshot
+        if (sd->dirty && dirty_log_clear(sd->dirty) < 0) {
+            return -1;
+        }
+        hdr.mem_offset = sizeof(hdr) + sizeof(struct snapshot_vcpu);
+    }
+    hdr.mem_offset =
+        (hdr.mem_offset + SNAPSHOT_ALIGN - 1) & ~(SNAPSHOT_ALIGN - 1);
+
+    printf("Saving %s snapshot to %s...\n", bitmap ? "delta" : "full", fname);
+    fflush(stdout);
+    fd = open(fname, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        perror("Cannot open snapshot");
+        goto out;
+    }
+
+    if (pwrite(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr)) {
+        perror("pwrite(snapshot header)");
+    } else if (snapshot_save_vcpu(fd, vcpu_fd) < 0) {
+        // already reported
+    } else if (bitmap && pwrite(fd, bitmap, bitmap_size, hdr.bitmap_offset) !=
+                             (ssize_t)bitmap_size) {
+        perror("pwrite(snapshot bitmap)");
+    } else if (snapshot_write_mem(fd, mem, mem_size, hdr.mem_offset, bitmap) <
+               0) {
+        // already reported
+    } else if (ftruncate(fd, hdr.mem_offset + mem_size) < 0) {
+        perror("ftruncate(snapshot)");
+    } else {
+        res = 0;
+    }
+    close(fd);
+
+out:
+    free(bitmap);
+    return res;
+}
+
+// only VMs with a single vCPU can be saved. The first snapshot is full, the
+// next ones are deltas (FILE.1, FILE.2...) with the pages dirtied since the
+// previous one, if dirty logging is enabled.
+int snapshot_take(struct snapshot_dev *sd, int vcpu_fd, struct kvm_run *r,
+                  void *mem, size_t mem_size) {
+    char fname[SNAPSHOT_PARENT_MAX];
+    int res;
+
+    sd->pending = 0;
+
+    // the port write is only complete (and the registers consistent) after
+    // re-entering KVM_RUN, which returns right away with immediate_exit
+    r->immediate_exit = 1;
+    res = ioctl(vcpu_fd, KVM_RUN, 0);
+    r->immediate_exit = 0;
+    if (res == 0 || errno != EINTR) {
+        perror("ioctl(KVM_RUN)");
+        return -1;
+    }
+
+    if (sd->parent && sd->dirty) {
+        snprintf(fname, sizeof(fname), "%s.%d", sd->fname, ++sd->seq);
+    } else {
+        snprintf(fname, sizeof(fname), "%s", sd->fname);
+        free(sd->parent);
+        sd->parent = NULL;
+    }
+    if (snapshot_write(sd, fname, vcpu_fd, mem, mem_size) < 0) {
+        return -1;
+    }
+
+    if (sd->dirty) {
+        free(sd->parent);
+        sd->parent = realpath(fname, NULL);
+        if (sd->parent == NULL ||
+            strlen(sd->parent) >= SNAPSHOT_PARENT_MAX) {
+            fprintf(stderr, "bad snapshot path %s\n", fname);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static int snapshot_read_header(struct snapshot *s,
+                                struct snapshot_header *hdr) {
+    if (pread(s->fd, hdr, sizeof(*hdr), 0) != sizeof(*hdr) ||
+        memcmp(hdr->magic, SNAPSHOT_MAGIC, sizeof(hdr->magic)) != 0 ||
+        hdr->mem_offset % SNAPSHOT_ALIGN != 0) {
+        fprintf(stderr, "not a snapshot\n");
+        return -1;
+    }
+    hdr->parent[sizeof(hdr->parent) - 1] = '\0';
+
+    return 0;
+}
+
+int snapshot_open(struct snapshot *s, const char *fname) {
+    struct snapshot_header hdr;
+
+    s->fd = open(fname, O_RDONLY | O_CLOEXEC);
+    if (s->fd < 0) {
+        perror("Cannot open snapshot");
+        return -1;
+    }
+    if (snapshot_read_header(s, &hdr) < 0) {
+        return -1;
+    }
+    s->nr_vcpus = hdr.nr_vcpus;
+    s->mem_size = hdr.mem_size;
+    s->mem_offset = hdr.mem_offset;
+    s->bitmap_offset = hdr.bitmap_offset;
+    s->parent = NULL;
+
+    if (hdr.bitmap_offset) {
+        printf("\t\t- Delta of %s\n", hdr.parent);
+        s->parent = malloc(sizeof(struct snapshot));
+        if (s->parent == NULL) {
+            perror("malloc(snapshot)");
+            return -1;
+        }
+        if (snapshot_open(s->parent, hdr.parent) < 0) {
+            return -1;
+        }
+        if (s->parent->mem_size != s->mem_size) {
+            fprintf(stderr, "%s: memory size does not match\n", hdr.parent);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+// copies the pages saved in a delta over the memory of its parent
+static int snapshot_apply_delta(struct snapshot *s, uint8_t *mem) {
+    size_t bitmap_size, p, off, len;
+    uint64_t *bitmap;
+    int res = 0;
+
+    bitmap_size = (s->mem_size / SNAPSHOT_PAGE_SIZE + 63) / 64 *
+                  sizeof(uint64_t);
+    bitmap = malloc(bitmap_size);
+    if (bitmap == NULL) {
+        perror("malloc(snapshot bitmap)");
+        return -1;
+    }
+    if (pread(s->fd, bitmap, bitmap_size, s->bitmap_offset) !=
+        (ssize_t)bitmap_size) {
+        perror("pread(snapshot bitmap)");
+        free(bitmap);
+        return -1;
+    }
+
+    for (off = 0; off < s->mem_size && res == 0; off += len) {
+        for (len = 0, p = off / SNAPSHOT_PAGE_SIZE;
+             off + len < s->mem_size && ((bitmap[p / 64] >> (p % 64)) & 1);
+             len += SNAPSHOT_PAGE_SIZE, p++);
+        if (len == 0) {
+            len = SNAPSHOT_PAGE_SIZE;
+            continue;
+        }
+        if (pread(s->fd, mem + off, len, s->mem_offset + off) !=
+            (ssize_t)len) {
+            perror("pread(snapshot memory)");
+            res = -1;
+        }
+    }
+    free(bitmap);
+
+    return res;
+}
+
+void *snapshot_map_mem(struct snapshot *s) {
+    void *addr;
+
+    // only the pages of the full snapshot are demand-paged, the deltas are
+    // copied over them
+    if (s->parent) {
+        addr = snapshot_map_mem(s->parent);
+        if (addr != MAP_FAILED && snapshot_apply_delta(s, addr) < 0) {
+            munmap(addr, s->mem_size);
+            addr = MAP_FAILED;
+        }
+        return addr;
+    }
+
+    // writes of the guest stay private, the snapshot can be restored again
+    addr = mmap(NULL, s->mem_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, s->fd,
+                s->mem_offset);
+    if (addr == MAP_FAILED) {
+        perror("mmap(snapshot)");
+    }
+
+    return addr;
+}
+
+int snapshot_restore_vcpu(struct snapshot *s, int id, int vcpu_fd) {
+    struct snapshot_vcpu v;
+
+    if (pread(s->fd, &v, sizeof(v),
+              sizeof(struct snapshot_header) + id * sizeof(v)) != sizeof(v)) {
+        perror("pread(snapshot vcpu)");
+        return -1;
+    }
+
+    if (ioctl(vcpu_fd, KVM_SET_SREGS, &v.sregs) < 0) {
+        perror("ioctl(KVM_SET_SREGS)");
+        return -1;
+    }
+    if (ioctl(vcpu_fd, KVM_SET_REGS, &v.regs) < 0) {
+        perror("ioctl(KVM_SET_REGS)");
+        return -1;
+    }
+    if (ioctl(vcpu_fd, KVM_SET_FPU, &v.fpu) < 0) {
+        perror("ioctl(KVM_SET_FPU)");
+        return -1;
+    }
+    if (ioctl(vcpu_fd, KVM_SET_LAPIC, &v.lapic) < 0) {
+        perror("ioctl(KVM_SET_LAPIC)");
+        return -1;
+    }
+    if (ioctl(vcpu_fd, KVM_SET_VCPU_EVENTS, &v.events) < 0) {
+        perror("ioctl(KVM_SET_VCPU_EVENTS)");
+        return -1;
+    }
+
+    return 0;
+}
+
+int snapshot_restore_hdd(struct snapshot *s, struct hdd **hdds, int nr_disks) {
+    struct snapshot_header hdr;
+
+    if (snapshot_read_header(s, &hdr) < 0) {
+        return -1;
+    }
+    if (hdr.nr_disks != (uint32_t)nr_disks) {
+        fprintf(stderr, "the snapshot has %u disks, got %d\n", hdr.nr_disks,
+                nr_disks);
+        return -1;
+    }
+
+    for (int i = 0; i < nr_disks; i++) {
+        if (hdd_load_state(hdds[i], &hdr.hdd[i]) < 0) return -1;
+    }
+    return 0;
+}
+
+int snapshot_restore_irqchip(struct snapshot *s, int vm_fd) {
+    struct snapshot_header hdr;
+
+    if (snapshot_read_header(s, &hdr) < 0) {
+        return -1;
+    }
+
+    for (int i = 0; i < 3; i++) {
+        if (ioctl(vm_fd, KVM_SET_IRQCHIP, &hdr.irqchip[i]) < 0) {
+            perror("ioctl(KVM_SET_IRQCHIP)");
+            return -1;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,44 @@
+#include <linux/kvm.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct hdd;
+struct dirty_log;
+
+// the guest asks for a snapshot through SNAPSHOT_PORT, it is taken by the
+// vCPU thread once the port write is complete
+struct snapshot_dev {
+    struct bus_device dev;
+    int vm_fd;  // to save the irqchip
+    const char *fname;  // NULL if snapshots are disabled
+    struct hdd **hdds;
+    int nr_disks;
+    struct dirty_log *dirty;  // NULL if only full snapshots are taken
+    char *parent;             // the last snapshot taken
+    int seq;
+    int pending;
+    int restored;
+};
+
+// a snapshot file opened for restoring
+struct snapshot {
+    int fd;
+    int nr_vcpus;
+    size_t mem_size;
+    uint64_t mem_offset;
+    uint64_t bitmap_offset;
+    struct snapshot *parent;  // for deltas
+};
+
+extern int snapshot_register(struct snapshot_dev *sd, struct bus *bus);
+extern int snapshot_take(struct snapshot_dev *sd, int vcpu_fd,
+                         struct kvm_run *r, void *mem, size_t mem_size);
+
+extern int snapshot_open(struct snapshot *s, const char *fname);
+// guest memory is mapped privately from the file, pages are read on demand
+extern void *snapshot_map_mem(struct snapshot *s);
+extern int snapshot_restore_vcpu(struct snapshot *s, int id, int vcpu_fd);
+// the PICs and the IOAPIC, the LAPICs are restored with their vCPU
+extern int snapshot_restore_irqchip(struct snapshot *s, int vm_fd);
+extern int snapshot_restore_hdd(struct snapshot *s, struct hdd **hdds,
+                                int nr_disks);
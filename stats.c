@@ -0,0 +1,201 @@
+#include "stats.h"
+
+#include <linux/kvm.h>
+#include <string.h>
+#include <time.h>
+
+#include "io.h"
+
+static const char *exit_reason_names[STATS_MAX_EXIT_REASONS] = {
+    [KVM_EXIT_UNKNOWN] = "unknown",
+    [KVM_EXIT_EXCEPTION] = "exception",
+    [KVM_EXIT_IO] = "io",
+    [KVM_EXIT_HYPERCALL] = "hypercall",
+    [KVM_EXIT_DEBUG] = "debug",
+    [KVM_EXIT_HLT] = "hlt",
+    [KVM_EXIT_MMIO] = "mmio",
+    [KVM_EXIT_IRQ_WINDOW_OPEN] = "irq_window_open",
+    [KVM_EXIT_SHUTDOWN] = "shutdown",
+    [KVM_EXIT_FAIL_ENTRY] = "fail_entry",
+    [KVM_EXIT_INTR] = "intr",
+    [KVM_EXIT_INTERNAL_ERROR] = "internal_error",
+};
+
+static const char *port_names[STATS_MAX_PORTS] = {
+    [SERIAL_PORT] = "serial",
+    [HDD_SECTOR_PORT] = "hdd_sector",
+    [HDD_DMA_ADDR_PORT] = "hdd_dma_addr",
+    [HDD_CMD_PORT] = "hdd_cmd",
+    [HDD_COUNT_PORT] = "hdd_count",
+    [SNAPSHOT_PORT] = "snapshot",
+};
+
+uint64_t stats_now(void) {
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1000000000ull + t.tv_nsec;
+}
+
+void stats_hist_add(struct stats_hist *h, uint64_t ns) {
+    int bucket = ns ? 63 - __builtin_clzll(ns) : 0;
+
+    if (bucket >= STATS_HIST_BUCKETS) bucket = STATS_HIST_BUCKETS - 1;
+
+    if (h->count == 0 || ns < h->min) h->min = ns;
+    if (ns > h->max) h->max = ns;
+    h->count++;
+    h->sum += ns;
+    h->buckets[bucket]++;
+}
+
+static void hist_merge(struct stats_hist *dst, const struct stats_hist *src) {
+    if (src->count == 0) return;
+
+    if (dst->count == 0 || src->min < dst->min) dst->min = src->min;
+    if (src->max > dst->max) dst->max = src->max;
+    dst->count += src->count;
+    dst->sum += src->sum;
+    for (int i = 0; i < STATS_HIST_BUCKETS; i++) {
+        dst->buckets[i] += src->buckets[i];
+    }
+}
+
+static void hist_dump_text(FILE *f, const char *name,
+                           const struct stats_hist *h) {
+    fprintf(f, "  %s: count=%lu avg=%luns min=%luns max=%luns\n", name,
+            h->count, h->count ? h->sum / h->count : 0, h->min, h->max);
+    for (int i = 0; i < STATS_HIST_BUCKETS; i++) {
+        if (h->buckets[i] == 0) continue;
+        fprintf(f, "    [%12lu, %12lu) ns: %lu\n", i ? 1ul << i : 0,
+                2ul << i, h->buckets[i]);
+    }
+}
+
+static void hist_dump_json(FILE *f, const struct stats_hist *h) {
+    int first = 1;
+
+    fprintf(f,
+            "{\"count\": %lu, \"sum_ns\": %lu, \"min_ns\": %lu, "
+            "\"max_ns\": %lu, \"buckets\": {",
+            h->count, h->sum, h->min, h->max);
+    for (int i = 0; i < STATS_HIST_BUCKETS; i++) {
+        if (h->buckets[i] == 0) continue;
+        fprintf(f, "%s\"%lu\": %lu", first ? "" : ", ", 2ul << i,
+                h->buckets[i]);
+        first = 0;
+    }
+    fprintf(f, "}}");
+}
+
+static void dump_text(FILE *f, struct vcpu_stats *t, int n,
+                      struct hdd_stats **hdds, int nr_disks) {
+    char name[32];
+
+    fprintf(f, "=== VM exit statistics (%d vCPUs) ===\n", n);
+    fprintf(f, "exits:\n");
+    for (int i = 0; i < STATS_MAX_EXIT_REASONS; i++) {
+        if (t->exits[i] == 0) continue;
+        fprintf(f, "  %-16s %lu\n",
+                exit_reason_names[i] ? exit_reason_names[i] : "other",
+                t->exits[i]);
+    }
+    fprintf(f, "port exits:\n");
+    for (int i = 0; i < STATS_MAX_PORTS; i++) {
+        if (t->port_exits[i] == 0) continue;
+        fprintf(f, "  0x%02x %-12s %lu\n", i,
+                port_names[i] ? port_names[i] : "other", t->port_exits[i]);
+    }
+    fprintf(f, "latency:\n");
+    hist_dump_text(f, "kvm_run", &t->run);
+    for (int i = 0; i < STATS_MAX_PORTS; i++) {
+        if (t->handler[i].count == 0) continue;
+        snprintf(name, sizeof(name), "handler 0x%02x %s", i,
+                 port_names[i] ? port_names[i] : "other");
+        hist_dump_text(f, name, &t->handler[i]);
+    }
+    for (int d = 0; d < nr_disks; d++) {
+        struct hdd_stats *hdd = hdds[d];
+
+        fprintf(f, "disk %d:\n", d);
+        fprintf(f, "  reads: %lu (%lu bytes)\n", hdd->reads, hdd->bytes_read);
+        fprintf(f, "  writes: %lu (%lu bytes)\n", hdd->writes,
+                hdd->bytes_written);
+        fprintf(f, "  flushes: %lu\n", hdd->flushes);
+        fprintf(f, "  errors: %lu\n", hdd->errors);
+    }
+}
+
+static void dump_json(FILE *f, struct vcpu_stats *t, int n,
+                      struct hdd_stats **hdds, int nr_disks) {
+    int first = 1;
+
+    fprintf(f, "{\"vcpus\": %d, \"exits\": {", n);
+    for (int i = 0; i < STATS_MAX_EXIT_REASONS; i++) {
+        if (t->exits[i] == 0) continue;
+        if (exit_reason_names[i]) {
+            fprintf(f, "%s\"%s\": %lu", first ? "" : ", ",
+                    exit_reason_names[i], t->exits[i]);
+        } else {
+            fprintf(f, "%s\"%d\": %lu", first ? "" : ", ", i, t->exits[i]);
+        }
+        first = 0;
+    }
+    fprintf(f, "}, \"port_exits\": {");
+    first = 1;
+    for (int i = 0; i < STATS_MAX_PORTS; i++) {
+        if (t->port_exits[i] == 0) continue;
+        fprintf(f, "%s\"%d\": %lu", first ? "" : ", ", i, t->port_exits[i]);
+        first = 0;
+    }
+    fprintf(f, "}, \"kvm_run\": ");
+    hist_dump_json(f, &t->run);
+    fprintf(f, ", \"handlers\": {");
+    first = 1;
+    for (int i = 0; i < STATS_MAX_PORTS; i++) {
+        if (t->handler[i].count == 0) continue;
+        fprintf(f, "%s\"%d\": ", first ? "" : ", ", i);
+        hist_dump_json(f, &t->handler[i]);
+        first = 0;
+    }
+    fprintf(f, "}");
+    fprintf(f, ", \"disks\": [");
+    for (int d = 0; d < nr_disks; d++) {
+        struct hdd_stats *hdd = hdds[d];
+
+        fprintf(f,
+                "%s{\"reads\": %lu, \"writes\": %lu, "
+                "\"bytes_read\": %lu, \"bytes_written\": %lu, "
+                "\"flushes\": %lu, \"errors\": %lu}",
+                d ? ", " : "", hdd->reads, hdd->writes, hdd->bytes_read,
+                hdd->bytes_written, hdd->flushes, hdd->errors);
+    }
+    fprintf(f, "]");
+    fprintf(f, "}\n");
+}
+
+// dumps the sum of the statistics of all the vCPUs. The vCPUs may still be
+// running, so the numbers of a live VM are only approximately consistent.
+void stats_dump(FILE *f, int format, struct vcpu_stats **vcpus, int n,
+                struct hdd_stats **hdds, int nr_disks) {
+    struct vcpu_stats total;
+
+    memset(&total, 0, sizeof(total));
+    for (int v = 0; v < n; v++) {
+        for (int i = 0; i < STATS_MAX_EXIT_REASONS; i++) {
+            total.exits[i] += vcpus[v]->exits[i];
+        }
+        for (int i = 0; i < STATS_MAX_PORTS; i++) {
+            total.port_exits[i] += vcpus[v]->port_exits[i];
+            hist_merge(&total.handler[i], &vcpus[v]->handler[i]);
+        }
+        hist_merge(&total.run, &vcpus[v]->run);
+    }
+
+    if (format == STATS_JSON) {
+        dump_json(f, &total, n, hdds, nr_disks);
+    } else {
+        dump_text(f, &total, n, hdds, nr_disks);
+    }
+    fflush(f);
+}
@@ -0,0 +1,43 @@
+#include <stdint.h>
+#include <stdio.h>
+
+// exit reasons and ports above these are counted in the last slot
+#define STATS_MAX_EXIT_REASONS 64
+#define STATS_MAX_PORTS 128
+
+// bucket i counts the samples in [2^i, 2^(i+1)) ns
+#define STATS_HIST_BUCKETS 40
+
+struct stats_hist {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t min;
+    uint64_t max;
+    uint64_t buckets[STATS_HIST_BUCKETS];
+};
+
+// statistics of a single vCPU, only updated by its own thread
+struct vcpu_stats {
+    uint64_t exits[STATS_MAX_EXIT_REASONS];
+    uint64_t port_exits[STATS_MAX_PORTS];
+    struct stats_hist run;  // time spent in KVM_RUN
+    struct stats_hist handler[STATS_MAX_PORTS];  // time spent handling I/O
+};
+
+// disk traffic, updated by any thread
+struct hdd_stats {
+    uint64_t reads;
+    uint64_t writes;
+    uint64_t bytes_read;
+    uint64_t bytes_written;
+    uint64_t flushes;
+    uint64_t errors;
+};
+
+#define STATS_TEXT 1
+#define STATS_JSON 2
+
+extern uint64_t stats_now(void);
+extern void stats_hist_add(struct stats_hist *h, uint64_t ns);
+extern void stats_dump(FILE *f, int format, struct vcpu_stats **vcpus, int n,
+                       struct hdd_stats **hdds, int nr_disks);
@@ -1,6 +1,10 @@
 #include <errno.h>
 #include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
 #include <linux/kvm.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stddef.h>
@@ -8,24 +12,141 @@
 #include <string.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
 #include "cpu.h"
 #include "host_io.h"
 #include "pd.h"
+#include "pool.h"
+#include "snapshot.h"
+#include "trace.h"
 
 const char guest_fname[] = "guest.flat";
 const char hdd_fname[] = "disk.raw";
 
+/* Page tables live right below the guest heap (which starts at 1 MB), the
+ * guest image is loaded at 0 and must not overlap them */
+#define PAGE_TABLES_ADDR 0x80000
+#define PAGE_TABLES_SIZE 0x80000
+// the GDT takes the last page of the page tables
+#define GDT_ADDR (PAGE_TABLES_ADDR + PAGE_TABLES_SIZE - 0x1000)
+
+// with --map-guest the image is mapped from its file into its own memory slot,
+// covering all the memory below the page tables
+#define GUEST_IMAGE_SLOT 2
+#define DAX_SLOT(disk) (3 + (disk))
+#define GUEST_IMAGE_SIZE PAGE_TABLES_ADDR
+
+// the memory set up before the guest runs: its image and the page tables
+#define BOOT_MEM_SIZE (PAGE_TABLES_ADDR + PAGE_TABLES_SIZE)
+
+#define PAGE_SIZE_2M (2ul << 20)
+#define PAGE_SIZE_1G (1ul << 30)
+
+
+#define HUGEPAGES_NONE 0
+#define HUGEPAGES_THP 1
+#define HUGEPAGES_HUGETLB 2
+
+#define VCPU_STACK_SIZE 0x10000
+
+#define DEFAULT_IO_THREADS 4
+
+struct options {
+    const char *guest_fname;
+    int map_guest;
+    const char *hdd_fnames[HDD_MAX_DISKS];
+    int nr_disks;
+    size_t mem_size;
+    int hugepages;
+    int vcpus;
+    int stats;
+    int async_hdd;
+    int hdd_uring;
+    int hdd_direct;
+    const char *hdd_cow_fname;
+    int hdd_writethrough;
+    const char *snapshot_fname;
+    const char *restore_fname;
+    unsigned int dirty_rate_ms;
+    int pool;
+    int runs;
+    int vms;
+    int workers;
+    int io_threads;
+    int dax;
+    const char *trace_fname;
+};
+
 struct vm_mem {
     uint8_t *addr;
     size_t size;
+    size_t low_size;  // RAM below the MMIO hole, the only one reachable by DMA
+    size_t image_size;  // size of the guest image slot, 0 if not mapped
+};
+
+struct vcpu;
+
+// the threads running the vCPUs, shared by all the VMs: launching a VM queues
+// its vCPUs, and each one is run by the next idle worker until the guest stops
+struct workers {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct vcpu *head, *tail;
+    int nr_threads;
+};
+
+// what the VMs of the process share
+struct host {
+    struct event_loop loop;
+    struct workers workers;
+    struct trace *trace;  // of the disk requests, NULL if disabled
 };
 
 struct vm {
+    int id;
+    char prefix[16];  // of the serial output, when there are many VMs
+    struct host *host;
     int fd;
     int vcpu_mmap_size;
     struct vm_mem mem;
+    struct vcpu *vcpus;
+    int nr_vcpus;
+    struct bus *bus;
+    struct serial serial;
+    struct hdd *hdds[HDD_MAX_DISKS];
+    int nr_disks;
+    struct snapshot_dev snapshot_dev;
+    struct dirty_log dirty;
+    // a pooled VM is reset to the memory below the heap as it was set up
+    uint8_t *boot_mem;
+    uint64_t *reset_bitmap;
+    struct kvm_irqchip boot_irqchip[3];  // the PICs and the IOAPIC
+
+    // the workers report when the guest stops on each vCPU
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int running;
+};
+
+struct vcpu {
+    int id;
+    int fd;
+    struct kvm_run *r;
+    struct vcpu *next;  // in the queue of the workers
+    struct vm *vm;
+    struct serial *serial;
+    struct bus *bus;
+    struct snapshot_dev *snapshot;
+    struct vcpu_stats *stats;  // NULL if statistics are disabled
+    int res;
+    uint64_t launched;  // when the last launch started running the vCPU
+    // registers as set up, restored when a pooled VM is reset
+    struct kvm_regs boot_regs;
+    struct kvm_sregs boot_sregs;
+    struct kvm_fpu boot_fpu;
+    struct kvm_lapic_state boot_lapic;
 };
 
 int kvm_open(void) {
@@ -56,36 +177,146 @@ int kvm_open(void) {
     return kvm_fd;
 }
 
-int guest_mem_init(struct vm *vm, int mem_size) {
+static int guest_mem_slot(struct vm *vm, int slot, uint64_t guest_phys_addr,
+                          size_t size, void *addr, __u32 flags) {
     struct kvm_userspace_memory_region region;
     int res;
 
-    vm->mem.addr = mmap(0, mem_size, PROT_READ | PROT_WRITE,
-                        MAP_SHARED | MAP_ANONYMOUS, -1, 0);
-    if (vm->mem.addr == NULL) {
+    region.slot = slot;
+    region.flags = flags;
+    region.guest_phys_addr = guest_phys_addr;
+    region.memory_size = size;
+    region.userspace_addr = (unsigned long)addr;
+    res = ioctl(vm->fd, KVM_SET_USER_MEMORY_REGION, &region);
+    if (res < 0) {
+        perror("ioctl(KVM_SET_USER_MEMORY_REGION)");
+
+        return -1;
+    }
+
+    return 0;
+}
+
+static void *guest_mem_alloc(size_t mem_size, int hugepages) {
+    uint8_t *addr;
+    size_t off;
+
+    if (hugepages == HUGEPAGES_HUGETLB) {
+        addr = mmap(0, mem_size, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (addr == MAP_FAILED) {
+            perror("mmap(MAP_HUGETLB)");
+        }
+        return addr;
+    }
+
+    // align the mapping to 2 MB, so that the huge pages of the host and of
+    // the guest page tables line up
+    addr = mmap(0, mem_size + PAGE_SIZE_2M, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (addr == MAP_FAILED) {
+        perror("mmap");
+        return addr;
+    }
+    off = PAGE_SIZE_2M - ((unsigned long)addr & (PAGE_SIZE_2M - 1));
+    munmap(addr, off);
+    addr += off;
+    munmap(addr + mem_size, PAGE_SIZE_2M - off);
+
+    if (hugepages == HUGEPAGES_THP &&
+        madvise(addr, mem_size, MADV_HUGEPAGE) < 0) {
+        perror("madvise(MADV_HUGEPAGE)");
+    }
+
+    return addr;
+}
+
+// maps the guest image over the start of its memory, so that the host view of
+// the memory stays contiguous. The pages are read from the page cache when the
+// guest touches them and are shared with the other VMs running the same image;
+// a VM only gets a private copy of the pages it writes.
+static int guest_image_map(struct vm *vm, const char *fname) {
+    struct stat st;
+    void *addr;
+    int fd;
+
+    fd = open(fname, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        perror("Cannot open file");
+        return -1;
+    }
+    if (fstat(fd, &st) < 0) {
+        perror("fstat");
+        close(fd);
+        return -1;
+    }
+    if (st.st_size > GUEST_IMAGE_SIZE) {
+        fprintf(stderr, "guest too big (%ld bytes)\n", (long)st.st_size);
+        close(fd);
+        return -1;
+    }
+
+    addr = mmap(vm->mem.addr, st.st_size, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_FIXED, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED) {
+        perror("mmap(guest image)");
+        return -1;
+    }
+    printf("\t- Mapped the guest image (size %lx)\n", (long)st.st_size);
+
+    return 0;
+}
+
+// mem is the memory of a restored snapshot, allocated here if NULL. If image
+// is set the guest image is mapped from that file instead of being copied by
+// guest_config.
+int guest_mem_init(struct vm *vm, size_t mem_size, int hugepages, void *mem,
+                   int log_dirty, const char *image) {
+    __u32 flags = log_dirty ? KVM_MEM_LOG_DIRTY_PAGES : 0;
+    size_t image_size = 0;
+
+    vm->mem.addr = mem ? mem : guest_mem_alloc(mem_size, hugepages);
+    if (vm->mem.addr == MAP_FAILED) {
         perror("MAlloc(VM Mem)");
 
         return -1;
     }
     vm->mem.size = mem_size;
+    vm->mem.low_size = mem_size < MMIO_ADDR ? mem_size : MMIO_ADDR;
     printf("\tAllocated guest memory (size %lx) at %p\n", vm->mem.size,
            vm->mem.addr);
-    region.slot = 0;
-    region.flags = 0;
-    region.guest_phys_addr = 0;
-    region.memory_size = vm->mem.size;
-    region.userspace_addr = (unsigned long)vm->mem.addr;
-    res = ioctl(vm->fd, KVM_SET_USER_MEMORY_REGION, &region);
-    if (res < 0) {
-        perror("ioctl(KVM_SET_USER_MEMORY_REGION)");
 
+    vm->mem.image_size = 0;
+
+    // the image slot ends with the anonymous memory after the file, up to the
+    // page tables
+    if (image) {
+        if (guest_image_map(vm, image) < 0) {
+            return -2;
+        }
+        image_size = GUEST_IMAGE_SIZE;
+        if (guest_mem_slot(vm, GUEST_IMAGE_SLOT, 0, image_size, vm->mem.addr,
+                           flags) < 0) {
+            return -2;
+        }
+        vm->mem.image_size = image_size;
+    }
+    if (guest_mem_slot(vm, 0, image_size, vm->mem.low_size - image_size,
+                       vm->mem.addr + image_size, flags) < 0) {
+        return -2;
+    }
+    if (vm->mem.size > vm->mem.low_size &&
+        guest_mem_slot(vm, 1, HIGH_MEM_ADDR, vm->mem.size - vm->mem.low_size,
+                       vm->mem.addr + vm->mem.low_size, flags) < 0) {
         return -2;
     }
 
     return 0;
 }
 
-struct vm *vm_create(int mem_size) {
+struct vm *vm_create(size_t mem_size, int hugepages, void *mem,
+                     int log_dirty, const char *image) {
     int kvm_fd;
     struct vm *vm;
 
@@ -94,7 +325,7 @@ struct vm *vm_create(int mem_size) {
         return NULL;
     }
 
-    vm = malloc(sizeof(struct vm));
+    vm = calloc(1, sizeof(struct vm));
     if (vm == NULL) {
         perror("MAlloc(vm)");
 
@@ -106,6 +337,12 @@ struct vm *vm_create(int mem_size) {
 
         return NULL;
     }
+    // the LAPICs, IOAPIC and PIC, which must exist before the vCPUs
+    if (ioctl(vm->fd, KVM_CREATE_IRQCHIP, 0) < 0) {
+        perror("ioctl(KVM_CREATE_IRQCHIP)");
+
+        return NULL;
+    }
     vm->vcpu_mmap_size = ioctl(kvm_fd, KVM_GET_VCPU_MMAP_SIZE, 0);
     if (vm->vcpu_mmap_size <= 0) {
         perror("ioctl(KVM_GET_VCPU_MMAP_SIZE)");
@@ -113,17 +350,17 @@ struct vm *vm_create(int mem_size) {
         return NULL;
     }
 
-    if (guest_mem_init(vm, mem_size) < 0) {
+    if (guest_mem_init(vm, mem_size, hugepages, mem, log_dirty, image) < 0) {
         return NULL;
     }
 
     return vm;
 }
 
-int vcpu_create(struct vm *vm, struct kvm_run **r) {
+int vcpu_create(struct vm *vm, int id, struct kvm_run **r) {
     int fd;
 
-    fd = ioctl(vm->fd, KVM_CREATE_VCPU, 0);
+    fd = ioctl(vm->fd, KVM_CREATE_VCPU, id);
     if (fd < 0) {
         perror("ioctl(KVM_CREATE_VCPU)");
 
@@ -132,7 +369,7 @@ int vcpu_create(struct vm *vm, struct kvm_run **r) {
 
     *r = mmap(NULL, vm->vcpu_mmap_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd,
               0);
-    if (r == MAP_FAILED) {
+    if (*r == MAP_FAILED) {
         perror("mmap kvm_run");
 
         return -3;
@@ -175,83 +412,134 @@ int dump_registers(int fd) {
     return 0;
 }
 
-int vm_run(int fd, struct kvm_run *r, struct vm_mem *mem, struct hdd *h) {
+int vm_run(struct vcpu *v) {
+    int id = v->id, fd = v->fd;
+    struct kvm_run *r = v->r;
+    struct serial *s = v->serial;
+    struct vcpu_stats *st = v->stats;
     struct kvm_regs regs;
+    uint64_t t = 0;
     int res;
 
     for (;;) {
+        if (st) t = stats_now();
         res = ioctl(fd, KVM_RUN, 0);
         if (res < 0) {
             perror("ioctl(KVM_RUN)");
 
             return -1;
         }
+        if (st) {
+            stats_hist_add(&st->run, stats_now() - t);
+            st->exits[r->exit_reason < STATS_MAX_EXIT_REASONS
+                          ? r->exit_reason
+                          : STATS_MAX_EXIT_REASONS - 1]++;
+        }
+
+        // print the output queued by the guest before it exited, which is
+        // not part of the time of the handler
+        serial_flush(s);
+        if (st) t = stats_now();
 
         switch (r->exit_reason) {
-            case KVM_EXIT_HLT:
-                res = ioctl(fd, KVM_GET_REGS, &regs);
-                if (res < 0) {
-                    perror("ioctl(KVM_GET_REGS)");
+            case KVM_EXIT_IO:
+                // the guest is done, HLT now waits for interrupts
+                if (r->io.port == EXIT_PORT) {
+                    res = ioctl(fd, KVM_GET_REGS, &regs);
+                    if (res < 0) {
+                        perror("ioctl(KVM_GET_REGS)");
 
-                    return -1;
-                }
+                        return -1;
+                    }
 
-                printf("EAX: %llx\n", regs.rax);
-                printf("EDX: %llx\n", regs.rdx);
+                    printf("VCPU %d EAX: %llx\n", id, regs.rax);
+                    printf("VCPU %d EDX: %llx\n", id, regs.rdx);
 
-                return 1;
-            case KVM_EXIT_MMIO:
-                if (!r->mmio.is_write) {
-                    printf("Unhandled MMIO read request!\n");
-                    return -1;
+                    return 1;
                 }
-
-                // emulate a normal io out, so that I don't need to rewrite the
-                // functions
-                __u64 phys_addr = r->mmio.phys_addr;
-                __u32 len = r->mmio.len;
-                // copy the data in the unused space after the io struct
-                int data_offset = offsetof(struct kvm_run, io) + sizeof(r->io);
-                __u8 *data = (__u8*) r + data_offset;
-
-                memcpy(data, r->mmio.data, 8);
-                r->io.count = 1;
-                r->io.data_offset = data_offset;
-                r->io.direction = KVM_EXIT_IO_OUT;
-                r->io.port = (phys_addr - MMIO_ADDR) / 8;
-                r->io.size = len;
                 // fall through
-            case KVM_EXIT_IO:
-                switch (r->io.port) {
-                    case SERIAL_PORT:
-                        res = handle_serial(r);
-                        if (res < 0) return res;
-                        continue;
-                    case HDD_CMD_PORT:
-                    case HDD_DMA_ADDR_PORT:
-                    case HDD_SECTOR_PORT:
-                        res = handle_hdd(h, r, mem->addr, mem->size);
-                        if (res < 0) return res;
-                        continue;
-                    default:
-                        printf(
-                            "No handler defined for: "
-                            "direction=%d "
-                            "port=%x "
-                            "size=%d\n",
-                            r->io.direction, r->io.port, r->io.size);
-                        return -1;
+            case KVM_EXIT_MMIO:
+                // both return the port (or MMIO register) that was accessed
+                res = r->exit_reason == KVM_EXIT_IO
+                          ? bus_handle_io(v->bus, id, r)
+                          : bus_handle_mmio(v->bus, id, r);
+                if (st && res >= 0) {
+                    int port =
+                        res < STATS_MAX_PORTS ? res : STATS_MAX_PORTS - 1;
+
+                    st->port_exits[port]++;
+                    stats_hist_add(&st->handler[port], stats_now() - t);
                 }
+                if (res < 0) return res;
+                if (v->snapshot && v->snapshot->pending &&
+                    snapshot_take(v->snapshot, fd, r, v->vm->mem.addr,
+                                  v->vm->mem.size) < 0) {
+                    return -1;
+                }
+                continue;
             default:
                 fprintf(stderr,
-                        "VM Exit reason: %d, expected KVM_EXIT_HLT (%d)\n",
-                        r->exit_reason, KVM_EXIT_HLT);
+                        "VM Exit reason: %d, expected KVM_EXIT_IO (%d)\n",
+                        r->exit_reason, KVM_EXIT_IO);
 
                 return -1;
         }
     }
 }
 
+static void *worker_thread(void *arg) {
+    struct workers *w = arg;
+    struct vcpu *v;
+    struct vm *vm;
+
+    for (;;) {
+        pthread_mutex_lock(&w->lock);
+        while (w->head == NULL) {
+            pthread_cond_wait(&w->cond, &w->lock);
+        }
+        v = w->head;
+        w->head = v->next;
+        if (w->head == NULL) w->tail = NULL;
+        pthread_mutex_unlock(&w->lock);
+
+        v->launched = stats_now();
+        v->res = vm_run(v);
+        if (v->res != 1) {
+            printf("Error: VCPU %d run returned %d\n", v->id, v->res);
+            dump_registers(v->fd);
+        }
+
+        vm = v->vm;
+        pthread_mutex_lock(&vm->lock);
+        if (--vm->running == 0) {
+            pthread_cond_broadcast(&vm->cond);
+        }
+        pthread_mutex_unlock(&vm->lock);
+    }
+
+    return NULL;
+}
+
+static int workers_init(struct workers *w, int nr_threads) {
+    pthread_t thread;
+    int res;
+
+    pthread_mutex_init(&w->lock, NULL);
+    pthread_cond_init(&w->cond, NULL);
+    w->head = w->tail = NULL;
+    w->nr_threads = nr_threads;
+    for (int i = 0; i < nr_threads; i++) {
+        res = pthread_create(&thread, NULL, worker_thread, w);
+        if (res != 0) {
+            fprintf(stderr, "pthread_create: %s\n", strerror(res));
+
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
 static void setup_64bit_code_segment(struct kvm_sregs *sregs) {
     struct kvm_segment seg = {
         .base = 0,
@@ -277,51 +565,106 @@ static void setup_64bit_code_segment(struct kvm_sregs *sregs) {
     sregs->ds = sregs->es = sregs->fs = sregs->gs = sregs->ss = seg;
 }
 
-static int system_registers_setup(struct vm *vm, int fd) {
-    int res;
-    struct kvm_sregs sregs;
+// maps [addr, addr + size) 1:1 with 2 MB pages, allocating the page
+// directories as needed
+static void map_range(struct vm *vm, uint64_t *next_pd, uint64_t addr,
+                      uint64_t size, uint64_t flags) {
+    uint64_t *pdpt = (uint64_t *)(vm->mem.addr + PAGE_TABLES_ADDR + 0x1000);
+    uint64_t *pd;
+
+    for (; size > 0; addr += PAGE_SIZE_2M) {
+        if (!(pdpt[addr / PAGE_SIZE_1G] & PDE64_PRESENT)) {
+            pdpt[addr / PAGE_SIZE_1G] =
+                PDE64_PRESENT | PDE64_RW | PDE64_USER | *next_pd;
+            *next_pd += 0x1000;
+        }
+        pd = (uint64_t *)(vm->mem.addr +
+                          (pdpt[addr / PAGE_SIZE_1G] & ~0xfffull));
+        pd[(addr % PAGE_SIZE_1G) / PAGE_SIZE_2M] =
+            PDE64_PRESENT | PDE64_RW | PDE64_USER | PDE64_PS | flags | addr;
+        size = size > PAGE_SIZE_2M ? size - PAGE_SIZE_2M : 0;
+    }
+}
 
-    printf("\t\t- Reading system registers\n");
-    fflush(stdout);
-    res = ioctl(fd, KVM_GET_SREGS, &sregs);
-    if (res < 0) {
-        perror("ioctl(KVM_GET_SREGS)");
+// the descriptors of the segments set by setup_64bit_code_segment, which the
+// CPU reloads when delivering interrupts and returning from them
+static void gdt_setup(struct vm *vm) {
+    uint64_t *gdt = (uint64_t *)(vm->mem.addr + GDT_ADDR);
 
-        return -1;
-    }
+    gdt[0] = 0;
+    gdt[1] = 0x00af9b000000ffffull;  // code: 64-bit, present, execute/read
+    gdt[2] = 0x00af93000000ffffull;  // data: present, read/write
+}
 
-    printf("\t\t- Setting up page tables...\n");
-    fflush(stdout);
-    uint64_t pml4_addr = 0x2000;
+// identity maps all the guest memory, the MMIO window and the interrupt
+// controllers with 2 MB pages
+static int page_tables_setup(struct vm *vm) {
+    uint64_t pml4_addr = PAGE_TABLES_ADDR;
     uint64_t *pml4 = (uint64_t *)(vm->mem.addr + pml4_addr);
+    uint64_t pdpt_addr = PAGE_TABLES_ADDR + 0x1000;
+    uint64_t next_pd = PAGE_TABLES_ADDR + 0x2000;
+    uint64_t high_size = vm->mem.size - vm->mem.low_size;
 
-    uint64_t pdpt_addr = 0x3000;
-    uint64_t *pdpt = (uint64_t *)(vm->mem.addr + pdpt_addr);
+    // a single PDPT maps up to 512 GB, with a PD for each GB (and each DAX
+    // window)
+    if (HIGH_MEM_ADDR + high_size > HDD_DAX_ADDR(0) ||
+        (HIGH_MEM_ADDR + high_size) / PAGE_SIZE_1G + 2 + HDD_MAX_DISKS >
+            PAGE_TABLES_SIZE / 0x1000 - 1) {
+        fprintf(stderr, "guest memory too big for the page tables\n");
 
-    uint64_t pd_addr = 0x4000;
-    uint64_t *pd = (uint64_t *)(vm->mem.addr + pd_addr);
+        return -1;
+    }
 
+    memset(pml4, 0, PAGE_TABLES_SIZE);
     printf("\t\t\t- PML4[0] %p (%p)...\n", pml4, vm->mem.addr);
     fflush(stdout);
     pml4[0] = PDE64_PRESENT | PDE64_RW | PDE64_USER | pdpt_addr;
-    printf("\t\t\t- PDPT[0] %p (%p)...\n", pdpt, vm->mem.addr);
-    fflush(stdout);
-    pdpt[0] = PDE64_PRESENT | PDE64_RW | PDE64_USER | pd_addr;
-    printf("\t\t\t- PD[0,1]...\n");
+
+    printf("\t\t\t- Low memory (size %lx)...\n", vm->mem.low_size);
     fflush(stdout);
-    pd[0] = PDE64_PRESENT | PDE64_RW | PDE64_USER | PDE64_PS;
+    map_range(vm, &next_pd, 0, vm->mem.low_size, 0);
     // io mem has cache disabled
-    pd[1] = PDE64_PRESENT | PDE64_RW | PDE64_USER
-            | PDE64_PWT | PDE64_PCD |  PDE64_PS
-            | MMIO_ADDR; // io mem is 0x200000-0x3fffff
+    map_range(vm, &next_pd, MMIO_ADDR, PAGE_SIZE_2M, PDE64_PWT | PDE64_PCD);
+    // so are the IOAPIC and the LAPIC, in the next 2 MB page
+    map_range(vm, &next_pd, IOAPIC_ADDR, 2 * PAGE_SIZE_2M,
+              PDE64_PWT | PDE64_PCD);
+    if (high_size > 0) {
+        printf("\t\t\t- High memory (size %lx)...\n", high_size);
+        fflush(stdout);
+        map_range(vm, &next_pd, HIGH_MEM_ADDR, high_size, 0);
+    }
+    // the DAX windows are mapped even if the disks are not
+    map_range(vm, &next_pd, HDD_DAX_ADDR(0),
+              HDD_MAX_DISKS * HDD_DAX_WINDOW_SIZE, 0);
+    gdt_setup(vm);
+
+    return 0;
+}
+
+static int system_registers_setup(int fd) {
+    int res;
+    struct kvm_sregs sregs;
+
+    printf("\t\t- Reading system registers\n");
+    fflush(stdout);
+    res = ioctl(fd, KVM_GET_SREGS, &sregs);
+    if (res < 0) {
+        perror("ioctl(KVM_GET_SREGS)");
+
+        return -1;
+    }
+
     printf("\t\t- Setting up CR* and EFER...\n");
     fflush(stdout);
-    sregs.cr3 = pml4_addr;
-    sregs.cr4 = CR4_PAE;
+    sregs.cr3 = PAGE_TABLES_ADDR;
+    // the guest is built for x86_64, which the compiler assumes has SSE
+    sregs.cr4 = CR4_PAE | CR4_OSFXSR | CR4_OSXMMEXCPT;
     sregs.cr0 = CR0_PE | CR0_MP | CR0_ET | CR0_NE | CR0_WP | CR0_AM | CR0_PG;
     sregs.efer = EFER_LME | EFER_LMA;
 
     setup_64bit_code_segment(&sregs);
+    sregs.gdt.base = GDT_ADDR;
+    sregs.gdt.limit = 3 * 8 - 1;
 
     printf("\t\t- Writing back system registers\n");
     fflush(stdout);
@@ -335,7 +678,7 @@ static int system_registers_setup(struct vm *vm, int fd) {
     return 0;
 }
 
-int registers_setup(int fd) {
+int registers_setup(int fd, int id, size_t mem_size, int nr_disks) {
     int res;
     struct kvm_regs regs;
 
@@ -343,8 +686,14 @@ int registers_setup(int fd) {
     /* Bit 1 in the rflags register must be always set. Clear all the other bits
      */
     regs.rflags = 2;
-    /* The stack is at top 2 MB and grows down */
-    regs.rsp = 2 << 20;
+    /* The stacks are at top 2 MB and grow down, one below the other */
+    regs.rsp = (2 << 20) - id * VCPU_STACK_SIZE;
+    /* The guest main receives the vCPU id as first argument */
+    regs.rdi = id;
+    /* ... and the size of its memory as the second one */
+    regs.rsi = mem_size;
+    /* ... and the number of disks as the third one */
+    regs.rdx = nr_disks;
 
     res = ioctl(fd, KVM_SET_REGS, &regs);
     if (res < 0) {
@@ -382,26 +731,62 @@ static int mmap_file(const char *fname, void **addr, const char *modes) {
     return size;
 }
 
-int guest_config(struct vm *vm, int fd) {
-    int guest_size;
-    void *guest;
+static int mp_state_setup(int fd) {
+    struct kvm_mp_state mp_state = {.mp_state = KVM_MP_STATE_RUNNABLE};
+
+    if (ioctl(fd, KVM_SET_MP_STATE, &mp_state) < 0) {
+        perror("ioctl(KVM_SET_MP_STATE)");
+
+        return -1;
+    }
+
+    return 0;
+}
 
-    printf("\t- Setting up system registers\n");
+int vcpu_config(struct vm *vm, int fd, int id, int nr_disks) {
+    printf("\t- Setting up system registers of VCPU %d\n", id);
     fflush(stdout);
-    if (system_registers_setup(vm, fd) < 0) {
+    if (system_registers_setup(fd) < 0) {
         return -9;
     }
 
-    printf("\t- Setting up user registers\n");
+    printf("\t- Setting up user registers of VCPU %d\n", id);
     fflush(stdout);
-    if (registers_setup(fd) < 0) {
+    if (registers_setup(fd, id, vm->mem.size, nr_disks) < 0) {
         return -10;
     }
 
+    // with the irqchip only the first vCPU starts running, the others wait
+    // for an INIT and SIPI from it. All of them start from the entry point.
+    if (mp_state_setup(fd) < 0) {
+        return -11;
+    }
+
+    return 0;
+}
+
+int guest_config(struct vm *vm, const char *fname) {
+    int guest_size;
+    void *guest;
+
+    printf("\t- Setting up page tables\n");
+    fflush(stdout);
+    if (page_tables_setup(vm) < 0) {
+        return -9;
+    }
+
+    if (vm->mem.image_size) {
+        return 0;
+    }
+
     printf("\t- Loading guest memory\n");
     fflush(stdout);
-    guest_size = mmap_file(guest_fname, &guest, "r");
+    guest_size = mmap_file(fname, &guest, "r");
     if (guest_size < 0) return -1;
+    if (guest_size > PAGE_TABLES_ADDR) {
+        fprintf(stderr, "guest too big (%d bytes)\n", guest_size);
+        return -1;
+    }
 
     printf("\t- Copying the guest to its memory\n");
     fflush(stdout);
@@ -410,13 +795,54 @@ int guest_config(struct vm *vm, int fd) {
     return 0;
 }
 
-static struct hdd *setup_hdd(const char *fname) {
+static struct hdd *setup_hdd(int id, struct options *opts, struct vm *vm) {
     struct hdd *h = (struct hdd *)calloc(1, sizeof(struct hdd));
+    const char *fname = opts->hdd_fnames[id];
+    char cow_fname[PATH_MAX];
     int res;
 
-    res = mmap_file(fname, &h->disk_addr, "r+");
-    if (res < 0) return NULL;
-    h->size = res;
+    printf("\t- Disk %d: %s\n", id, fname);
+    hdd_init(h, id);
+    h->trace = vm->host->trace;
+    h->vm = vm->id;
+    if (opts->hdd_cow_fname) {
+        // the overlays of the other disks are FILE.1, FILE.2..., and those of
+        // the other VMs FILE.vm1, FILE.vm1.1...
+        res = snprintf(cow_fname, sizeof(cow_fname), "%s",
+                       opts->hdd_cow_fname);
+        if (vm->id > 0) {
+            res += snprintf(cow_fname + res, sizeof(cow_fname) - res, ".vm%d",
+                            vm->id);
+        }
+        if (id > 0) {
+            snprintf(cow_fname + res, sizeof(cow_fname) - res, ".%d", id);
+        }
+        printf("\t- Using the copy-on-write overlay %s\n", cow_fname);
+        res = hdd_cow_setup(h, cow_fname, fname);
+        if (res < 0) return NULL;
+    } else if (opts->hdd_uring) {
+        printf("\t- Using the io_uring backend%s\n",
+               opts->hdd_direct ? " (O_DIRECT)" : "");
+        // registering pins the memory for writing, which would give the VM
+        // its own copy of a mapped image. The high memory is out of reach of
+        // the DMA.
+        res = hdd_uring_setup(h, fname, opts->hdd_direct,
+                              vm->mem.addr + vm->mem.image_size,
+                              vm->mem.low_size - vm->mem.image_size);
+        if (res < 0) return NULL;
+    } else {
+        res = mmap_file(fname, &h->disk_addr, "r+");
+        if (res < 0) return NULL;
+        h->size = res;
+        h->backend = &hdd_mmap_backend;
+    }
+    if (opts->hdd_writethrough) {
+        printf("\t- Disk cache in writethrough mode\n");
+        h->writethrough = 1;
+    }
+    // DMA is limited to the low memory, so that 32-bit addresses suffice
+    h->guest_mem_addr = vm->mem.addr;
+    h->guest_mem_size = vm->mem.low_size;
 
     if (h->size % HDD_SECTOR_SIZE != 0) {
         printf("disk must be a multiple of %d in size ", HDD_SECTOR_SIZE);
@@ -426,46 +852,856 @@ static struct hdd *setup_hdd(const char *fname) {
     return h;
 }
 
-int main() {
-    int res;
-    int vcpu_fd;
+// maps the start of the disk image in the guest memory, where the guest reads
+// and writes it without any exit. The writes reach the page cache directly,
+// HDD_CMD_DAX_FLUSH makes them durable.
+static int dax_setup(struct vm *vm, struct hdd *h) {
+    size_t size = h->size < HDD_DAX_WINDOW_SIZE ? h->size : HDD_DAX_WINDOW_SIZE;
+
+    // memory slots are made of whole pages
+    size &= ~(size_t)0xfff;
+    printf("\t- DAX window of disk %d at %#lx (size %zx)\n", h->id,
+           HDD_DAX_ADDR(h->id), size);
+    if (size > 0 && guest_mem_slot(vm, DAX_SLOT(h->id), HDD_DAX_ADDR(h->id),
+                                   size, h->disk_addr, 0) < 0) {
+        return -1;
+    }
+    h->dax_size = size;
+
+    return 0;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s [options]\n"
+            "  -g, --guest=FILE          guest image (default %s)\n"
+            "  -M, --map-guest           map the guest image instead of "
+            "copying it\n"
+            "  -D, --disk=FILE           disk image (default %s), repeat for "
+            "up to %d\n"
+            "                            disks\n"
+            "  -m, --mem=SIZE            guest memory, with K/M/G suffix "
+            "(default 2M)\n"
+            "  -H, --hugepages=MODE      back guest memory with thp or "
+            "hugetlb pages\n"
+            "  -n, --vcpus=N             number of vCPUs (default 1, max %d)\n"
+            "  -s, --stats[=FORMAT]      collect VM exit statistics, dumped "
+            "on exit\n"
+            "                            and on SIGUSR1 as text (default) or "
+            "json\n"
+            "  -a, --async-hdd           process the disk ring on an I/O "
+            "thread\n"
+            "  -b, --hdd-backend=NAME    disk backend: mmap (default) or "
+            "uring\n"
+            "  -d, --hdd-direct          open the disk with O_DIRECT (uring "
+            "only)\n"
+            "  -c, --cow=FILE            write to a copy-on-write overlay of "
+            "the disk,\n"
+            "                            created if it does not exist\n"
+            "  -C, --cache=MODE          disk cache: writeback (default, the "
+            "guest\n"
+            "                            flushes) or writethrough\n"
+            "  -S, --snapshot=FILE       save the VM to FILE when the guest "
+            "asks for it\n"
+            "  -R, --restore=FILE        resume the VM saved in FILE instead "
+            "of booting\n"
+            "  -r, --dirty-rate=MS       print the rate of dirtied guest "
+            "pages every MS\n"
+            "                            (on stderr)\n"
+            "  -p, --pool=N              set up N VMs in advance and launch "
+            "the guest\n"
+            "                            on them, resetting them after each "
+            "run\n"
+            "  -N, --runs=N              number of runs with --pool "
+            "(default 2 per VM)\n"
+            "  -V, --vms=N               run the guest on N VMs at the same "
+            "time, with a\n"
+            "                            copy-on-write overlay each\n"
+            "  -w, --workers=N           threads running the vCPUs of all the "
+            "VMs\n"
+            "                            (default enough for all of them)\n"
+            "  -i, --io-threads=N        threads of the event loop of the "
+            "devices (default\n"
+            "                            %d)\n"
+            "  -x, --dax                 map the disks in the guest memory "
+            "(mmap backend\n"
+            "                            only)\n"
+            "  -t, --trace=FILE          record the disk requests to FILE, "
+            "see replay\n"
+            "  -h, --help                show this message\n",
+            prog, guest_fname, hdd_fname, HDD_MAX_DISKS, MAX_VCPUS,
+            DEFAULT_IO_THREADS);
+}
+
+struct stats_dumper {
+    int format;
+    struct vcpu *vcpus;
+    int n;
+    struct hdd **hdds;
+    int nr_disks;
+};
+
+static void dump_stats(struct stats_dumper *d) {
+    struct vcpu_stats *stats[MAX_VCPUS];
+    struct hdd_stats *hdd_stats[HDD_MAX_DISKS];
+
+    for (int i = 0; i < d->n; i++) {
+        stats[i] = d->vcpus[i].stats;
+    }
+    for (int i = 0; i < d->nr_disks; i++) {
+        hdd_stats[i] = &d->hdds[i]->stats;
+    }
+    stats_dump(stderr, d->format, stats, d->n, hdd_stats, d->nr_disks);
+}
+
+// SIGUSR1 is blocked in all the other threads, and dumps the statistics
+static void *stats_thread(void *arg) {
+    struct stats_dumper *d = arg;
+    sigset_t set;
+    int sig;
+
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+    for (;;) {
+        if (sigwait(&set, &sig) == 0) {
+            dump_stats(d);
+        }
+    }
+
+    return NULL;
+}
+
+static size_t parse_size(const char *s) {
+    char *end;
+    size_t size = strtoull(s, &end, 0);
+
+    switch (*end) {
+        case 'G':
+        case 'g':
+            return size << 30;
+        case 'M':
+        case 'm':
+            return size << 20;
+        case 'K':
+        case 'k':
+            return size << 10;
+        case '\0':
+            return size;
+        default:
+            return 0;
+    }
+}
+
+static int parse_args(int argc, char *argv[], struct options *opts) {
+    static const struct option long_opts[] = {
+        {"guest", required_argument, NULL, 'g'},
+        {"map-guest", no_argument, NULL, 'M'},
+        {"disk", required_argument, NULL, 'D'},
+        {"mem", required_argument, NULL, 'm'},
+        {"hugepages", required_argument, NULL, 'H'},
+        {"vcpus", required_argument, NULL, 'n'},
+        {"stats", optional_argument, NULL, 's'},
+        {"async-hdd", no_argument, NULL, 'a'},
+        {"hdd-backend", required_argument, NULL, 'b'},
+        {"hdd-direct", no_argument, NULL, 'd'},
+        {"cow", required_argument, NULL, 'c'},
+        {"cache", required_argument, NULL, 'C'},
+        {"snapshot", required_argument, NULL, 'S'},
+        {"restore", required_argument, NULL, 'R'},
+        {"dirty-rate", required_argument, NULL, 'r'},
+        {"pool", required_argument, NULL, 'p'},
+        {"runs", required_argument, NULL, 'N'},
+        {"vms", required_argument, NULL, 'V'},
+        {"workers", required_argument, NULL, 'w'},
+        {"io-threads", required_argument, NULL, 'i'},
+        {"dax", no_argument, NULL, 'x'},
+        {"trace", required_argument, NULL, 't'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0},
+    };
+    static const char short_opts[] =
+        "g:MD:m:H:n:s::ab:dc:C:S:R:r:p:N:V:w:i:xt:h";
+    int c;
+
+    memset(opts, 0, sizeof(*opts));
+    opts->guest_fname = guest_fname;
+    opts->mem_size = PAGE_SIZE_2M;
+    opts->vcpus = 1;
+    opts->vms = 1;
+    opts->io_threads = DEFAULT_IO_THREADS;
+    while ((c = getopt_long(argc, argv, short_opts, long_opts, NULL)) != -1) {
+        switch (c) {
+            case 'g':
+                opts->guest_fname = optarg;
+                break;
+            case 'M':
+                opts->map_guest = 1;
+                break;
+            case 'D':
+                if (opts->nr_disks == HDD_MAX_DISKS) {
+                    fprintf(stderr, "at most %d disks\n", HDD_MAX_DISKS);
+                    return -1;
+                }
+                opts->hdd_fnames[opts->nr_disks++] = optarg;
+                break;
+            case 'm':
+                opts->mem_size = parse_size(optarg);
+                // the guest stacks are right below 2 MB
+                if (opts->mem_size < PAGE_SIZE_2M ||
+                    opts->mem_size % PAGE_SIZE_2M != 0) {
+                    fprintf(stderr, "memory must be a multiple of 2M\n");
+                    return -1;
+                }
+                break;
+            case 'H':
+                if (strcmp(optarg, "thp") == 0) {
+                    opts->hugepages = HUGEPAGES_THP;
+                } else if (strcmp(optarg, "hugetlb") == 0) {
+                    opts->hugepages = HUGEPAGES_HUGETLB;
+                } else {
+                    usage(argv[0]);
+                    return -1;
+                }
+                break;
+            case 'n':
+                opts->vcpus = atoi(optarg);
+                if (opts->vcpus < 1 || opts->vcpus > MAX_VCPUS) {
+                    usage(argv[0]);
+                    return -1;
+                }
+                break;
+            case 's':
+                if (optarg == NULL || strcmp(optarg, "text") == 0) {
+                    opts->stats = STATS_TEXT;
+                } else if (strcmp(optarg, "json") == 0) {
+                    opts->stats = STATS_JSON;
+                } else {
+                    usage(argv[0]);
+                    return -1;
+                }
+                break;
+            case 'a':
+                opts->async_hdd = 1;
+                break;
+            case 'b':
+                if (strcmp(optarg, "uring") == 0) {
+                    opts->hdd_uring = 1;
+                } else if (strcmp(optarg, "mmap") != 0) {
+                    usage(argv[0]);
+                    return -1;
+                }
+                break;
+            case 'd':
+                opts->hdd_direct = 1;
+                break;
+            case 'c':
+                opts->hdd_cow_fname = optarg;
+                break;
+            case 'C':
+                if (strcmp(optarg, "writethrough") == 0) {
+                    opts->hdd_writethrough = 1;
+                } else if (strcmp(optarg, "writeback") != 0) {
+                    usage(argv[0]);
+                    return -1;
+                }
+                break;
+            case 'S':
+                opts->snapshot_fname = optarg;
+                break;
+            case 'R':
+                opts->restore_fname = optarg;
+                break;
+            case 'r':
+                opts->dirty_rate_ms = atoi(optarg);
+                if (opts->dirty_rate_ms == 0) {
+                    usage(argv[0]);
+                    return -1;
+                }
+                break;
+            case 'p':
+                opts->pool = atoi(optarg);
+                if (opts->pool < 1) {
+                    usage(argv[0]);
+                    return -1;
+                }
+                break;
+            case 'N':
+                opts->runs = atoi(optarg);
+                if (opts->runs < 1) {
+                    usage(argv[0]);
+                    return -1;
+                }
+                break;
+            case 'V':
+                opts->vms = atoi(optarg);
+                if (opts->vms < 1) {
+                    usage(argv[0]);
+                    return -1;
+                }
+                break;
+            case 'w':
+                opts->workers = atoi(optarg);
+                if (opts->workers < 1) {
+                    usage(argv[0]);
+                    return -1;
+                }
+                break;
+            case 'i':
+                opts->io_threads = atoi(optarg);
+                if (opts->io_threads < 1) {
+                    usage(argv[0]);
+                    return -1;
+                }
+                break;
+            case 'x':
+                opts->dax = 1;
+                break;
+            case 't':
+                opts->trace_fname = optarg;
+                break;
+            default:
+                usage(argv[0]);
+                return -1;
+        }
+    }
+
+    if (opts->nr_disks == 0) {
+        opts->hdd_fnames[opts->nr_disks++] = hdd_fname;
+    }
+
+    // the other vCPUs could not be stopped while saving
+    if (opts->snapshot_fname && opts->vcpus != 1) {
+        fprintf(stderr, "snapshots need a single vCPU\n");
+        return -1;
+    }
+    // the pooled VMs share the disks and run the guest from its start
+    if (opts->pool && (opts->hdd_cow_fname || opts->snapshot_fname ||
+                       opts->restore_fname || opts->dirty_rate_ms ||
+                       opts->stats)) {
+        fprintf(stderr, "--pool does not support --cow, --snapshot, "
+                        "--restore, --dirty-rate and --stats\n");
+        return -1;
+    }
+    if (opts->pool && opts->runs == 0) {
+        opts->runs = 2 * opts->pool;
+    }
+    if (opts->vms > 1 && (!opts->hdd_cow_fname || opts->pool ||
+                          opts->snapshot_fname || opts->restore_fname ||
+                          opts->stats)) {
+        fprintf(stderr, "--vms needs --cow (the VMs would write to the same "
+                        "disks) and does not\nsupport --pool, --snapshot, "
+                        "--restore and --stats\n");
+        return -1;
+    }
+    // the vCPUs of a VM may wait for each other, they must all run at once
+    if (opts->workers == 0) {
+        opts->workers = opts->vms * opts->vcpus;
+    } else if (opts->workers < opts->vcpus) {
+        fprintf(stderr, "at least %d workers are needed\n", opts->vcpus);
+        return -1;
+    }
+    // the other backends do not map the image
+    if (opts->dax && (opts->hdd_uring || opts->hdd_cow_fname)) {
+        fprintf(stderr, "--dax needs the mmap backend\n");
+        return -1;
+    }
+    // huge pages cannot be partially replaced by the image
+    if (opts->map_guest && opts->hugepages == HUGEPAGES_HUGETLB) {
+        fprintf(stderr, "the guest image cannot be mapped on hugetlb pages\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+// saves what vm_reset restores
+static int vm_save_boot_state(struct vm *vm) {
+    struct vcpu *v;
+
+    vm->boot_mem = malloc(BOOT_MEM_SIZE);
+    vm->reset_bitmap = calloc(vm->dirty.words, sizeof(uint64_t));
+    if (vm->boot_mem == NULL || vm->reset_bitmap == NULL) {
+        perror("MAlloc(boot state)");
+        return -1;
+    }
+    memcpy(vm->boot_mem, vm->mem.addr, BOOT_MEM_SIZE);
+
+    for (int i = 0; i < vm->nr_vcpus; i++) {
+        v = &vm->vcpus[i];
+        if (ioctl(v->fd, KVM_GET_REGS, &v->boot_regs) < 0 ||
+            ioctl(v->fd, KVM_GET_SREGS, &v->boot_sregs) < 0 ||
+            ioctl(v->fd, KVM_GET_FPU, &v->boot_fpu) < 0 ||
+            ioctl(v->fd, KVM_GET_LAPIC, &v->boot_lapic) < 0) {
+            perror("ioctl(KVM_GET_REGS)");
+            return -1;
+        }
+    }
+    for (int i = 0; i < 3; i++) {
+        vm->boot_irqchip[i].chip_id = i;
+        if (ioctl(vm->fd, KVM_GET_IRQCHIP, &vm->boot_irqchip[i]) < 0) {
+            perror("ioctl(KVM_GET_IRQCHIP)");
+            return -1;
+        }
+    }
+
+    // from now on only the pages written by the guest and the disks are logged
+    return dirty_log_clear(&vm->dirty);
+}
+
+// brings a VM whose guest stopped back to the state it was set up in. Only
+// the pages written since are restored: from the mapped image file, from the
+// copy of the memory below the heap, or zeroed.
+static int vm_reset(void *arg) {
+    struct vm *vm = arg;
+    struct vcpu *v;
+    size_t off;
+
+    if (dirty_log_take(&vm->dirty, vm->reset_bitmap) < 0) {
+        return -1;
+    }
+    for (size_t i = 0; i < vm->dirty.words; i++) {
+        for (uint64_t w = vm->reset_bitmap[i]; w; w &= w - 1) {
+            off = (i * 64 + __builtin_ctzll(w)) * DIRTY_PAGE_SIZE;
+            if (off < vm->mem.image_size) {
+                // drops the private copy of the page
+                if (madvise(vm->mem.addr + off, DIRTY_PAGE_SIZE,
+                            MADV_DONTNEED) < 0) {
+                    perror("madvise(MADV_DONTNEED)");
+                    return -1;
+                }
+            } else if (off < BOOT_MEM_SIZE) {
+                memcpy(vm->mem.addr + off, vm->boot_mem + off,
+                       DIRTY_PAGE_SIZE);
+            } else {
+                memset(vm->mem.addr + off, 0, DIRTY_PAGE_SIZE);
+            }
+        }
+    }
+
+    for (int i = 0; i < vm->nr_vcpus; i++) {
+        v = &vm->vcpus[i];
+        if (ioctl(v->fd, KVM_SET_SREGS, &v->boot_sregs) < 0 ||
+            ioctl(v->fd, KVM_SET_REGS, &v->boot_regs) < 0 ||
+            ioctl(v->fd, KVM_SET_FPU, &v->boot_fpu) < 0 ||
+            ioctl(v->fd, KVM_SET_LAPIC, &v->boot_lapic) < 0) {
+            perror("ioctl(KVM_SET_REGS)");
+            return -1;
+        }
+    }
+    for (int i = 0; i < 3; i++) {
+        if (ioctl(vm->fd, KVM_SET_IRQCHIP, &vm->boot_irqchip[i]) < 0) {
+            perror("ioctl(KVM_SET_IRQCHIP)");
+            return -1;
+        }
+    }
+    for (int i = 0; i < vm->nr_disks; i++) {
+        hdd_reset(vm->hdds[i]);
+    }
+
+    return 0;
+}
+
+// creates a VM ready to run the guest: memory, vCPUs and devices. id numbers
+// the VMs of the process, restore is the snapshot to resume or NULL.
+static struct vm *vm_setup(struct host *host, struct options *opts, int id,
+                           struct snapshot *restore) {
     struct vm *vm;
-    struct kvm_run *r;
-    struct hdd *h;
+    struct vcpu *vcpus;
+    void *mem = NULL;
+    int res;
 
-    printf("Simple kvm test...\n");
-    fflush(stdout);
-    vm = vm_create(0x200000);
+    if (restore) {
+        mem = snapshot_map_mem(restore);
+        if (mem == MAP_FAILED) {
+            return NULL;
+        }
+    }
+    // snapshots after the first one only save the pages written since, and a
+    // pooled VM only resets them. A restored guest already has its image in
+    // the snapshot.
+    vm = vm_create(opts->mem_size, opts->hugepages, mem,
+                   opts->snapshot_fname || opts->dirty_rate_ms || opts->pool,
+                   opts->map_guest && !restore ? opts->guest_fname : NULL);
     if (vm == NULL) {
-        return -1;
+        return NULL;
+    }
+    vm->id = id;
+    vm->host = host;
+    vcpus = calloc(opts->vcpus, sizeof(struct vcpu));
+    if (vcpus == NULL) {
+        perror("MAlloc(vcpus)");
+
+        return NULL;
+    }
+    vm->vcpus = vcpus;
+    vm->nr_vcpus = opts->vcpus;
+    for (int i = 0; i < opts->vcpus; i++) {
+        printf("Creating VCPU %d...\n", i);
+        fflush(stdout);
+        vcpus[i].id = i;
+        vcpus[i].vm = vm;
+        if (opts->stats) {
+            vcpus[i].stats = calloc(1, sizeof(struct vcpu_stats));
+            if (vcpus[i].stats == NULL) {
+                perror("MAlloc(vcpu_stats)");
+
+                return NULL;
+            }
+        }
+        vcpus[i].fd = vcpu_create(vm, i, &vcpus[i].r);
+        if (vcpus[i].fd < 0) {
+            return NULL;
+        }
+    }
+    // needed to convert the cycles measured by the guest
+    res = ioctl(vcpus[0].fd, KVM_GET_TSC_KHZ, 0);
+    if (res > 0) {
+        printf("\t- TSC frequency: %d kHz\n", res);
     }
-    printf("Creating VCPU...\n");
-    fflush(stdout);
-    vcpu_fd = vcpu_create(vm, &r);
 
     printf("Configuring the guest...\n");
     fflush(stdout);
-    res = guest_config(vm, vcpu_fd);
-    if (res < 0) {
+    for (int i = 0; i < opts->vcpus; i++) {
+        // a restored guest resumes where it was saved, its page tables and
+        // code are already in memory
+        if (restore) {
+            res = snapshot_restore_vcpu(restore, i, vcpus[i].fd);
+        } else {
+            res = vcpu_config(vm, vcpus[i].fd, i, opts->nr_disks);
+        }
+        if (res < 0) {
+            return NULL;
+        }
+    }
+    if (!restore) {
+        res = guest_config(vm, opts->guest_fname);
+        if (res < 0) {
+            return NULL;
+        }
+    }
+
+    // the lookup tables are too large for the stack
+    vm->bus = (struct bus *)malloc(sizeof(struct bus));
+    if (vm->bus == NULL) {
+        perror("malloc(bus)");
+        return NULL;
+    }
+    bus_init(vm->bus);
+
+    printf("Configuring the serial port...\n");
+    fflush(stdout);
+    if (opts->vms > 1) {
+        snprintf(vm->prefix, sizeof(vm->prefix), "[vm %d] ", id);
+    }
+    if (serial_setup(&vm->serial, vm->fd, vcpus[0].r, &host->loop,
+                     opts->vms > 1 ? vm->prefix : NULL) < 0) {
+        return NULL;
+    }
+    if (serial_register(&vm->serial, vm->bus) < 0) {
+        return NULL;
+    }
+
+    printf("Configuring the disks...\n");
+    fflush(stdout);
+    vm->nr_disks = opts->nr_disks;
+    for (int i = 0; i < opts->nr_disks; i++) {
+        vm->hdds[i] = setup_hdd(i, opts, vm);
+        if (vm->hdds[i] == NULL) {
+            return NULL;
+        }
+        if (hdd_register(vm->hdds[i], vm->bus) < 0) {
+            return NULL;
+        }
+        if (hdd_irq_setup(vm->hdds[i], vm->fd) < 0) {
+            return NULL;
+        }
+        if (opts->dax && dax_setup(vm, vm->hdds[i]) < 0) {
+            return NULL;
+        }
+    }
+    if (restore &&
+        (snapshot_restore_hdd(restore, vm->hdds, opts->nr_disks) < 0 ||
+         snapshot_restore_irqchip(restore, vm->fd) < 0)) {
+        return NULL;
+    }
+
+    if (opts->snapshot_fname || opts->dirty_rate_ms || opts->pool) {
+        if (dirty_log_init(&vm->dirty, vm->fd, vm->mem.size, vm->mem.low_size,
+                           vm->mem.image_size) < 0) {
+            return NULL;
+        }
+        for (int i = 0; i < opts->nr_disks; i++) {
+            vm->hdds[i]->dirty = &vm->dirty;
+        }
+    }
+    if (opts->dirty_rate_ms &&
+        dirty_log_start_rate(&vm->dirty, opts->dirty_rate_ms, &host->loop) <
+            0) {
+        return NULL;
+    }
+    if (opts->async_hdd) {
+        printf("\t- Handling the disk kicks in the event loop\n");
+        fflush(stdout);
+        for (int i = 0; i < opts->nr_disks; i++) {
+            if (hdd_async_start(vm->hdds[i], vm->fd, &host->loop) < 0) {
+                return NULL;
+            }
+        }
+    }
+
+    vm->snapshot_dev.fname = opts->snapshot_fname;
+    vm->snapshot_dev.vm_fd = vm->fd;
+    vm->snapshot_dev.hdds = vm->hdds;
+    vm->snapshot_dev.nr_disks = opts->nr_disks;
+    vm->snapshot_dev.dirty = vm->hdds[0]->dirty;
+    vm->snapshot_dev.restored = restore != NULL;
+    if (snapshot_register(&vm->snapshot_dev, vm->bus) < 0) {
+        return NULL;
+    }
+
+    if (opts->pool && vm_save_boot_state(vm) < 0) {
+        return NULL;
+    }
+
+    pthread_mutex_init(&vm->lock, NULL);
+    pthread_cond_init(&vm->cond, NULL);
+    for (int i = 0; i < opts->vcpus; i++) {
+        vcpus[i].serial = &vm->serial;
+        vcpus[i].bus = vm->bus;
+        vcpus[i].snapshot = &vm->snapshot_dev;
+    }
+
+    return vm;
+}
+
+// starts the guest on all the vCPUs, they are queued at once so that they run
+// together as long as there are enough workers
+static void vm_launch(struct vm *vm) {
+    struct workers *w = &vm->host->workers;
+
+    pthread_mutex_lock(&vm->lock);
+    vm->running = vm->nr_vcpus;
+    pthread_mutex_unlock(&vm->lock);
+
+    pthread_mutex_lock(&w->lock);
+    for (int i = 0; i < vm->nr_vcpus; i++) {
+        vm->vcpus[i].next = NULL;
+        if (w->tail) {
+            w->tail->next = &vm->vcpus[i];
+        } else {
+            w->head = &vm->vcpus[i];
+        }
+        w->tail = &vm->vcpus[i];
+    }
+    pthread_cond_broadcast(&w->cond);
+    pthread_mutex_unlock(&w->lock);
+}
+
+// waits for all the vCPUs to stop, returns 0 if the guest exited on all of them
+static int vm_wait(struct vm *vm) {
+    pthread_mutex_lock(&vm->lock);
+    while (vm->running > 0) {
+        pthread_cond_wait(&vm->cond, &vm->lock);
+    }
+    pthread_mutex_unlock(&vm->lock);
+
+    for (int i = 0; i < vm->nr_vcpus; i++) {
+        if (vm->vcpus[i].res != 1) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+// launches the guest opts->runs times, on VMs taken from a pool of opts->pool
+// VMs that are set up in advance and reset in the background between runs
+static int pool_run(struct host *host, struct options *opts) {
+    struct vm **vms;
+    struct vm *vm;
+    struct pool pool;
+    uint64_t t, latency, created = 0, total = 0, max = 0;
+    int res = 0;
+
+    vms = calloc(opts->pool, sizeof(struct vm *));
+    if (vms == NULL) {
+        perror("MAlloc(pool)");
+
         return -1;
     }
+    for (int i = 0; i < opts->pool; i++) {
+        printf("Creating pooled VM %d...\n", i);
+        fflush(stdout);
+        t = stats_now();
+        vms[i] = vm_setup(host, opts, i, NULL);
+        if (vms[i] == NULL) {
+            return -1;
+        }
+        created += stats_now() - t;
+    }
+    if (pool_init(&pool, (void **)vms, opts->pool, vm_reset) < 0) {
+        return -1;
+    }
+
+    for (int i = 0; i < opts->runs; i++) {
+        t = stats_now();
+        vm = pool_get(&pool);
+        if (vm == NULL) {
+            fprintf(stderr, "no VM left in the pool\n");
+
+            return -1;
+        }
+        vm_launch(vm);
+        if (vm_wait(vm) < 0) {
+            res = -1;
+        }
+        // up to the first KVM_RUN of the first vCPU
+        latency = vm->vcpus[0].launched - t;
+        total += latency;
+        if (latency > max) max = latency;
+        printf("Run %d done (launched in %lu us)\n", i, latency / 1000);
+        fflush(stdout);
+        pool_put(&pool, vm);
+    }
+
+    printf("Pool: %d VMs set up in %lu us each, %d runs launched in %lu us "
+           "on average (max %lu us)\n",
+           opts->pool, created / opts->pool / 1000, opts->runs,
+           total / opts->runs / 1000, max / 1000);
 
-    printf("Configuring the disk...\n");
+    return res;
+}
+
+// runs the guest once on opts->vms VMs at the same time
+static int vms_run(struct host *host, struct options *opts) {
+    struct vm **vms;
+    int res = 0;
+
+    vms = calloc(opts->vms, sizeof(struct vm *));
+    if (vms == NULL) {
+        perror("MAlloc(vms)");
+
+        return -1;
+    }
+    for (int i = 0; i < opts->vms; i++) {
+        printf("Creating VM %d...\n", i);
+        fflush(stdout);
+        vms[i] = vm_setup(host, opts, i, NULL);
+        if (vms[i] == NULL) {
+            return -1;
+        }
+    }
+
+    printf("And running them!\n");
     fflush(stdout);
-    h = setup_hdd(hdd_fname);
-    if (h == NULL) {
+    for (int i = 0; i < opts->vms; i++) {
+        vm_launch(vms[i]);
+    }
+    for (int i = 0; i < opts->vms; i++) {
+        if (vm_wait(vms[i]) < 0) {
+            printf("Error: VM %d failed\n", i);
+            res = -1;
+        }
+    }
+
+    return res;
+}
+
+// runs the guest once on a single VM, booted or restored from a snapshot
+static int vm_run_once(struct host *host, struct options *opts) {
+    int res;
+    struct vm *vm;
+    struct stats_dumper dumper;
+    pthread_t dumper_thread;
+    struct snapshot snapshot;
+
+    if (opts->restore_fname) {
+        printf("\t- Restoring snapshot %s\n", opts->restore_fname);
+        if (snapshot_open(&snapshot, opts->restore_fname) < 0) {
+            return -1;
+        }
+        if (snapshot.nr_vcpus != opts->vcpus) {
+            fprintf(stderr, "the snapshot has %d vCPUs\n", snapshot.nr_vcpus);
+            return -1;
+        }
+        opts->mem_size = snapshot.mem_size;
+    }
+    vm = vm_setup(host, opts, 0, opts->restore_fname ? &snapshot : NULL);
+    if (vm == NULL) {
         return -1;
     }
 
+    if (opts->stats) {
+        dumper.format = opts->stats;
+        dumper.vcpus = vm->vcpus;
+        dumper.n = opts->vcpus;
+        dumper.hdds = vm->hdds;
+        dumper.nr_disks = opts->nr_disks;
+        res = pthread_create(&dumper_thread, NULL, stats_thread, &dumper);
+        if (res != 0) {
+            fprintf(stderr, "pthread_create: %s\n", strerror(res));
+
+            return -1;
+        }
+    }
+
     printf("And running it!\n");
     fflush(stdout);
-    res = vm_run(vcpu_fd, r, &vm->mem, h);
-    if (res != 1) {
-        printf("Error: run returned %d\n", res);
-        dump_registers(vcpu_fd);
+    vm_launch(vm);
+    res = vm_wait(vm);
 
+    if (opts->stats) {
+        fflush(stdout);
+        dump_stats(&dumper);
+    }
+
+    return res;
+}
+
+int main(int argc, char *argv[]) {
+    struct options opts;
+    int res;
+    sigset_t sigset;
+    struct host host;
+    struct trace trace;
+
+    if (parse_args(argc, argv, &opts) < 0) {
         return -1;
     }
 
-    return 0;
+    if (opts.stats) {
+        // only the statistics thread handles SIGUSR1
+        sigemptyset(&sigset);
+        sigaddset(&sigset, SIGUSR1);
+        pthread_sigmask(SIG_BLOCK, &sigset, NULL);
+    }
+
+    printf("Simple kvm test...\n");
+    fflush(stdout);
+    if (event_loop_init(&host.loop, opts.io_threads) < 0 ||
+        workers_init(&host.workers, opts.workers) < 0) {
+        return -1;
+    }
+    host.trace = NULL;
+    if (opts.trace_fname) {
+        if (trace_open(&trace, opts.trace_fname) < 0) {
+            return -1;
+        }
+        host.trace = &trace;
+    }
+
+    if (opts.pool) {
+        res = pool_run(&host, &opts);
+    } else if (opts.vms > 1) {
+        res = vms_run(&host, &opts);
+    } else {
+        res = vm_run_once(&host, &opts);
+    }
+
+    // the guests are done, no request is left
+    if (host.trace && trace_close(host.trace) < 0) {
+        res = -1;
+    }
+
+    return res;
 }
@@ -0,0 +1,70 @@
+#include "trace.h"
+
+#include <string.h>
+
+#include "stats.h"
+
+int trace_open(struct trace *t, const char *fname) {
+    struct trace_header hdr;
+
+    t->f = fopen(fname, "w");
+    if (t->f == NULL) {
+        perror("Cannot open trace");
+        return -1;
+    }
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, TRACE_MAGIC, sizeof(hdr.magic));
+    hdr.record_size = sizeof(struct trace_record);
+    if (fwrite(&hdr, sizeof(hdr), 1, t->f) != 1) {
+        perror("fwrite(trace header)");
+        return -1;
+    }
+    t->start = stats_now();
+    pthread_mutex_init(&t->lock, NULL);
+
+    return 0;
+}
+
+void trace_add(struct trace *t, const struct trace_record *recs,
+               unsigned int n) {
+    pthread_mutex_lock(&t->lock);
+    if (t->f && fwrite(recs, sizeof(*recs), n, t->f) != n) {
+        perror("fwrite(trace)");
+    }
+    pthread_mutex_unlock(&t->lock);
+}
+
+int trace_close(struct trace *t) {
+    int res = 0;
+
+    pthread_mutex_lock(&t->lock);
+    if (fclose(t->f) != 0) {
+        perror("fclose(trace)");
+        res = -1;
+    }
+    t->f = NULL;
+    pthread_mutex_unlock(&t->lock);
+
+    return res;
+}
+
+FILE *trace_read_open(const char *fname) {
+    struct trace_header hdr;
+    FILE *f;
+
+    f = fopen(fname, "r");
+    if (f == NULL) {
+        perror("Cannot open trace");
+        return NULL;
+    }
+    if (fread(&hdr, sizeof(hdr), 1, f) != 1 ||
+        memcmp(hdr.magic, TRACE_MAGIC, sizeof(hdr.magic)) != 0 ||
+        hdr.record_size != sizeof(struct trace_record)) {
+        fprintf(stderr, "%s: not a trace\n", fname);
+        fclose(f);
+        return NULL;
+    }
+
+    return f;
+}
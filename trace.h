@@ -0,0 +1,44 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// binary trace of the requests completed by the disk backends: a header, then
+// a record for each request in the order they completed
+#define TRACE_MAGIC "KVMTRC1"
+
+struct trace_header {
+    char magic[8];
+    uint32_t record_size;
+    uint32_t pad;
+};
+
+struct trace_record {
+    uint64_t time;     // submission, in ns since the trace was opened
+    uint64_t latency;  // ns until the backend completed it
+    uint64_t off;      // in bytes, like len
+    uint32_t len;      // 0 for a flush of the whole disk
+    uint8_t cmd;       // HDD_CMD_READ, HDD_CMD_WRITE or HDD_CMD_FLUSH
+    uint8_t fua;
+    uint8_t disk;
+    uint8_t queue;
+    uint16_t vm;
+    int16_t vcpu;  // -1 if submitted by the event loop
+    int16_t err;
+    uint16_t pad;
+};
+
+// shared by all the disks of all the VMs, records are written with a single
+// buffered write per batch
+struct trace {
+    FILE *f;  // NULL once closed
+    uint64_t start;
+    pthread_mutex_t lock;
+};
+
+extern int trace_open(struct trace *t, const char *fname);
+extern void trace_add(struct trace *t, const struct trace_record *recs,
+                      unsigned int n);
+extern int trace_close(struct trace *t);
+
+// reads the header of a trace, the records follow
+extern FILE *trace_read_open(const char *fname);